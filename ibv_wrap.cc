@@ -8,12 +8,22 @@
 #include <v8.h>
 #include <node.h>
 #include <node_buffer.h>
+#include <uv.h>
 
 // C/C++
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <iostream>
+#include <list>
+#include <map>
+#include <vector>
+#include <deque>
+#include <cerrno>
+
+// POSIX
+#include <fcntl.h>
 
 // IB Verbs
 #include <infiniband/verbs.h>
@@ -28,6 +38,219 @@ static Persistent<String> family_symbol;
 static Persistent<String> address_symbol;
 static Persistent<String> port_symbol;
 
+// Inline capacity requested at QP creation unless the caller asks otherwise.
+static const uint32_t IBV_DEFAULT_MAX_INLINE = 256;
+
+// Wraps a cached MR for JS. Internal field 0 holds the MRCache::Entry*.
+static Persistent<ObjectTemplate> mr_template;
+
+//
+// Pin-down cache for memory registrations.
+//
+// Registrations are kept in an interval map keyed by start address and
+// reference counted. A request which falls inside an existing MR with at
+// least the requested access rights reuses it instead of calling
+// ibv_reg_mr() again. Unreferenced MRs stay registered on an LRU list and are
+// only deregistered when the pinned-memory ceiling would be exceeded. With
+// the ceiling set to 0 nothing idle is kept: an MR is deregistered as soon
+// as its last reference goes.
+//
+// Each entry holds a persistent handle on its Buffer, so the registered
+// memory cannot be freed and reused while it is still pinned.
+//
+class MRCache {
+public:
+
+  struct Entry {
+    struct ibv_mr*                  mr;
+    uintptr_t                       start;
+    size_t                          length;
+    int                             access;
+    int                             refs;
+    Persistent<Object>              buffer;
+    std::list<Entry*>::iterator     lru_pos;    // Valid when refs == 0
+  };
+
+  MRCache() : limit_(0), pinned_bytes_(0), max_length_(0),
+              hits_(0), misses_(0), evictions_(0) { }
+
+  ~MRCache() {
+    Clear();
+  }
+
+  //
+  // Returns a referenced MR covering [addr, addr + length), or NULL if the
+  // registration failed or could not fit under the ceiling.
+  //
+  Entry* Acquire(struct ibv_pd* pd, Handle<Object> buffer,
+                 void* addr, size_t length, int access) {
+    uintptr_t start = (uintptr_t)addr;
+
+    Entry* e = Find(start, length, access);
+    if (e) {
+      hits_++;
+      Ref(e);
+      return e;
+    }
+
+    misses_++;
+
+    if (limit_ > 0) {
+      while (pinned_bytes_ + length > limit_ && !lru_.empty()) {
+        Evict(lru_.back());
+      }
+
+      if (pinned_bytes_ + length > limit_) {
+        return NULL;
+      }
+    }
+
+    struct ibv_mr* mr = ibv_reg_mr(pd, addr, length, access);
+    if (!mr) {
+      return NULL;
+    }
+
+    e = new Entry();
+    e->mr       = mr;
+    e->start    = start;
+    e->length   = length;
+    e->access   = access;
+    e->refs     = 1;
+    e->buffer   = Persistent<Object>::New(buffer);
+
+    entries_.insert(std::make_pair(start, e));
+    pinned_bytes_ += length;
+    if (length > max_length_) {
+      max_length_ = length;
+    }
+
+    return e;
+  }
+
+  void Release(Entry* e) {
+    assert(e->refs > 0);
+
+    if (--e->refs == 0) {
+      lru_.push_front(e);
+      e->lru_pos = lru_.begin();
+
+      if (limit_ == 0 || pinned_bytes_ > limit_) {
+        Evict(e);
+      }
+    }
+  }
+
+  //
+  // Sets the pinned-memory ceiling in bytes and evicts idle MRs down to it.
+  // 0 disables caching: referenced MRs are not limited, idle ones are
+  // dropped right away.
+  //
+  void SetLimit(size_t limit) {
+    limit_ = limit;
+
+    while (!lru_.empty() && (limit_ == 0 || pinned_bytes_ > limit_)) {
+      Evict(lru_.back());
+    }
+  }
+
+  void Clear() {
+    std::multimap<uintptr_t, Entry*>::iterator it;
+    for (it = entries_.begin(); it != entries_.end(); ++it) {
+      Deregister(it->second);
+    }
+
+    entries_.clear();
+    lru_.clear();
+    pinned_bytes_ = 0;
+    max_length_ = 0;
+  }
+
+  size_t pinned_bytes() const { return pinned_bytes_; }
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  uint64_t evictions() const { return evictions_; }
+
+private:
+
+  //
+  // A covering entry starts at or before `start`, but no further back than
+  // the longest registration we hold, which bounds the scan.
+  //
+  Entry* Find(uintptr_t start, size_t length, int access) {
+    std::multimap<uintptr_t, Entry*>::iterator it = entries_.upper_bound(start);
+
+    while (it != entries_.begin()) {
+      --it;
+
+      Entry* e = it->second;
+      if (e->start + max_length_ < start + length) {
+        break;
+      }
+
+      if (e->start + e->length >= start + length &&
+          (e->access & access) == access) {
+        return e;
+      }
+    }
+
+    return NULL;
+  }
+
+  void Ref(Entry* e) {
+    if (e->refs++ == 0) {
+      lru_.erase(e->lru_pos);
+    }
+  }
+
+  void Evict(Entry* e) {
+    assert(e->refs == 0);
+
+    lru_.erase(e->lru_pos);
+
+    std::multimap<uintptr_t, Entry*>::iterator it = entries_.lower_bound(e->start);
+    while (it->second != e) {
+      ++it;
+    }
+    entries_.erase(it);
+
+    pinned_bytes_ -= e->length;
+    evictions_++;
+
+    Deregister(e);
+  }
+
+  void Deregister(Entry* e) {
+    int ret = ibv_dereg_mr(e->mr);
+    assert(ret == 0);
+
+    e->buffer.Dispose();
+    delete e;
+  }
+
+  std::multimap<uintptr_t, Entry*>  entries_;
+  std::list<Entry*>                 lru_;       // Idle entries, most recent first
+
+  size_t                            limit_;
+  size_t                            pinned_bytes_;
+  size_t                            max_length_;
+
+  uint64_t                          hits_;
+  uint64_t                          misses_;
+  uint64_t                          evictions_;
+};
+
+//
+// A posted work request whose Buffer must stay alive until its completion
+// is reaped. wr_id points at this.
+//
+struct PendingWR {
+  Persistent<Object>    buffer;     // Buffer, or Array of Buffers for SG lists
+  Persistent<Function>  callback;   // (status, byte_len, buffer), may be empty
+  uint32_t              byte_len;   // Reported for sends retired unsignaled
+  bool                  signaled;   // Sends only, see IBV::QueueSend()
+  bool                  registered; // Every SG entry has an MR, see BuildSGList()
+};
+
 class IBV : public node::ObjectWrap {
 public:
 
@@ -47,13 +270,21 @@ public:
     NODE_SET_PROTOTYPE_METHOD(t, "comp_channel", CompChannel);
     NODE_SET_PROTOTYPE_METHOD(t, "cq", CQ);
     NODE_SET_PROTOTYPE_METHOD(t, "resize_cq", ResizeCQ);
+    NODE_SET_PROTOTYPE_METHOD(t, "close", Close);
     NODE_SET_PROTOTYPE_METHOD(t, "qp", QP);
     NODE_SET_PROTOTYPE_METHOD(t, "mr", MR);
+    NODE_SET_PROTOTYPE_METHOD(t, "dereg_mr", DeregMR);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_mr_cache_limit", SetMRCacheLimit);
+    NODE_SET_PROTOTYPE_METHOD(t, "mr_cache_stats", MRCacheStats);
 
     NODE_SET_PROTOTYPE_METHOD(t, "query_device", QueryDevice);
     NODE_SET_PROTOTYPE_METHOD(t, "query_port", QueryPort);
 
     NODE_SET_PROTOTYPE_METHOD(t, "post_send", PostSend);
+    NODE_SET_PROTOTYPE_METHOD(t, "post_recv", PostRecv);
+    NODE_SET_PROTOTYPE_METHOD(t, "post_send_batch", PostSendBatch);
+    NODE_SET_PROTOTYPE_METHOD(t, "post_recv_batch", PostRecvBatch);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_signal_interval", SetSignalInterval);
 
     // @todo {}
     //NODE_SET_PROTOTYPE_METHOD(t, "make_send_wr", MakeSendWR);
@@ -61,6 +292,9 @@ public:
 
     ibvConstructor = Persistent<Function>::New(t->GetFunction());
 
+    mr_template = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+    mr_template->SetInternalFieldCount(1);
+
     target->Set(String::NewSymbol("IBV"), ibvConstructor);
 
   }
@@ -72,9 +306,14 @@ private:
 
     IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
 
-    ibv->pd_ = ibv_alloc_pd(ibv->ctx_);
-    assert(ibv->pd_);
+    if (!ibv->pd_) {
+      ibv->pd_ = ibv_alloc_pd(ibv->ctx_);
+      if (!ibv->pd_) {
+        return ThrowException(ErrnoException(errno, "ibv_alloc_pd"));
+      }
+    }
 
+    return args.This();
   }
 
   static Handle<Value> CompChannel(const Arguments& args) {
@@ -104,12 +343,308 @@ private:
 
     IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
 
+    // One CQ per object; resize_cq() changes its size.
+    if (ibv->cq_) {
+      return Undefined();
+    }
+
     ibv->cq_ = ibv_create_cq(ibv->ctx_, num_cq, NULL, ibv->comp_channel_, 0);
     assert(ibv->cq_);
 
     int ret = ibv_req_notify_cq(ibv->cq_, 0);
     assert(ret == 0);
 
+    if (ibv->comp_channel_) {
+      ibv->StartPolling();
+    }
+
+    return Undefined();
+  }
+
+  //
+  // Completions are reaped on the loop thread from the comp channel fd.
+  //
+  void StartPolling() {
+    int fd = comp_channel_->fd;
+
+    int flags = fcntl(fd, F_GETFL);
+    assert(flags >= 0);
+    int ret = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    assert(ret == 0);
+
+    ret = uv_poll_init(uv_default_loop(), &poll_handle_, fd);
+    assert(ret == 0);
+    poll_handle_.data = this;
+
+    ret = uv_poll_start(&poll_handle_, UV_READABLE, OnCompChannelReadable);
+    assert(ret == 0);
+
+    // The loop points into this object until the handle is closed, see
+    // Close().
+    polling_ = true;
+    Ref();
+  }
+
+  //
+  // Stops reaping completions. Work requests still pending are flushed
+  // first: the QP goes to the error state and polling stops once their
+  // callbacks ran, see Complete(). The object can only be collected once
+  // the poll handle has been closed.
+  //
+  static Handle<Value> Close(const Arguments& args) {
+    HandleScope scope;
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+
+    if (ibv->closing_) {
+      return Undefined();
+    }
+    ibv->closing_ = true;
+
+    if (ibv->wrs_pending_ > 0 && ibv->qp_) {
+      struct ibv_qp_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.qp_state = IBV_QPS_ERR;
+
+      int ret = ibv_modify_qp(ibv->qp_, &attr, IBV_QP_STATE);
+      assert(ret == 0);
+      return Undefined();
+    }
+
+    ibv->StopPolling();
+
+    return Undefined();
+  }
+
+  void StopPolling() {
+    if (polling_) {
+      uv_poll_stop(&poll_handle_);
+      uv_close((uv_handle_t*)&poll_handle_, OnPollClosed);
+      polling_ = false;
+    }
+  }
+
+  static void OnPollClosed(uv_handle_t* handle) {
+    IBV *ibv = (IBV*)handle->data;
+    ibv->Unref();
+  }
+
+  static void OnCompChannelReadable(uv_poll_t* handle, int status, int events) {
+    IBV *ibv = (IBV*)handle->data;
+    struct ibv_cq *cq;
+    void *cq_context;
+
+    if (status < 0) {
+      fprintf(stderr, "Failed to poll completion channel\n");
+      return;
+    }
+
+    unsigned int nevents = 0;
+    while (ibv_get_cq_event(ibv->comp_channel_, &cq, &cq_context) == 0) {
+      nevents++;
+    }
+    assert(errno == EAGAIN);
+
+    if (nevents == 0) {
+      return;
+    }
+
+    ibv_ack_cq_events(ibv->cq_, nevents);
+
+    int ret = ibv_req_notify_cq(ibv->cq_, 0);
+    assert(ret == 0);
+
+    ibv->DrainCQ();
+  }
+
+  void DrainCQ() {
+    struct ibv_wc wc[16];
+    int n;
+
+    while ((n = ibv_poll_cq(cq_, 16, wc)) > 0) {
+      for (int i = 0; i < n; i++) {
+        // The opcode is undefined for error completions, so those are told
+        // apart by wr_id.
+        bool send;
+        if (wc[i].status == IBV_WC_SUCCESS) {
+          send = !(wc[i].opcode & IBV_WC_RECV);
+        } else {
+          send = IsQueuedSend((PendingWR*)(uintptr_t)wc[i].wr_id);
+        }
+
+        if (send) {
+          RetireSends(&wc[i]);
+        } else {
+          Complete((PendingWR*)(uintptr_t)wc[i].wr_id, wc[i].status, wc[i].byte_len);
+        }
+      }
+    }
+
+    assert(n == 0);
+  }
+
+  //
+  // Send completions arrive in posting order, so a signaled completion also
+  // retires every unsignaled send still queued ahead of it.
+  //
+  void RetireSends(const struct ibv_wc* wc) {
+    PendingWR *last = (PendingWR*)(uintptr_t)wc->wr_id;
+
+    while (!send_queue_.empty()) {
+      PendingWR *req = send_queue_.front();
+      send_queue_.pop_front();
+
+      if (req->signaled) {
+        signaled_outstanding_--;
+      }
+
+      if (req == last) {
+        Complete(req, wc->status, req->byte_len);
+        break;
+      }
+
+      Complete(req, IBV_WC_SUCCESS, req->byte_len);
+    }
+
+    // Sends left behind the last signaled one would never be retired if
+    // no more sends come.
+    if (signaled_outstanding_ == 0 && !send_queue_.empty()) {
+      PostFlush();
+    }
+  }
+
+  bool IsQueuedSend(const PendingWR *req) const {
+    return std::find(send_queue_.begin(), send_queue_.end(), req) != send_queue_.end();
+  }
+
+  //
+  // Posts a signaled zero-length RDMA write behind unsignaled sends. Its
+  // completion retires them. No data moves, so the remote key is not
+  // checked and no receive is consumed on the peer.
+  //
+  void PostFlush() {
+    PendingWR *req = new PendingWR();
+    req->byte_len = 0;
+    req->signaled = true;
+
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id      = (uintptr_t)req;
+    wr.opcode     = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.num_sge    = 0;
+
+    send_queue_.push_back(req);
+    signaled_outstanding_++;
+    sends_since_signal_ = 0;
+
+    struct ibv_send_wr *bad_wr = NULL;
+    if (ibv_post_send(qp_, &wr, &bad_wr)) {
+      UnqueueSends(1);
+      delete req;
+      return;
+    }
+
+    // Complete() releases it like any other work request.
+    HoldWR();
+  }
+
+  //
+  // Returns the send_flags for the next send and queues it for retirement.
+  // A send is signaled every signal_interval_ sends, or when the send queue
+  // is about to fill up and must be drained. The first send after the
+  // queue went idle is signaled too, so that a completion always arrives
+  // to retire the sends behind it (see RetireSends()).
+  //
+  int QueueSend(PendingWR *req) {
+    send_queue_.push_back(req);
+    req->signaled = false;
+
+    if (++sends_since_signal_ >= signal_interval_ ||
+        send_queue_.size() + 1 >= max_send_wr_ ||
+        signaled_outstanding_ == 0) {
+      sends_since_signal_ = 0;
+      req->signaled = true;
+      signaled_outstanding_++;
+      return IBV_SEND_SIGNALED;
+    }
+
+    return 0;
+  }
+
+  //
+  // Adds IBV_SEND_INLINE when the payload fits the QP's inline capacity:
+  // the HCA then takes the data from the WQE instead of DMA-reading it, and
+  // no registered memory is needed. Returns false for a payload that is too
+  // big to go inline but lacks an MR for one of its SG entries.
+  //
+  bool InlineFlags(const PendingWR *req, int *flags) {
+    if (req->byte_len <= max_inline_data_) {
+      *flags |= IBV_SEND_INLINE;
+      return true;
+    }
+
+    return req->registered;
+  }
+
+  //
+  // Every posted work request keeps the object alive until Complete().
+  //
+  void HoldWR() {
+    wrs_pending_++;
+    Ref();
+  }
+
+  //
+  // Undoes QueueSend() for sends which failed to post. They were queued
+  // last, so they are at the tail.
+  //
+  void UnqueueSends(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      if (send_queue_.back()->signaled) {
+        signaled_outstanding_--;
+      }
+      send_queue_.pop_back();
+    }
+  }
+
+  //
+  // Releases the Buffer of a completed work request and reports it.
+  //
+  void Complete(PendingWR *req, int status, uint32_t byte_len) {
+    HandleScope scope;
+
+    if (!req) {
+      return;
+    }
+
+    Local<Object> buffer = Local<Object>::New(req->buffer);
+    req->buffer.Dispose();
+
+    if (!req->callback.IsEmpty()) {
+      Local<Value> argv[3] = {
+        Integer::New(status),
+        Integer::NewFromUnsigned(byte_len),
+        buffer
+      };
+
+      TryCatch try_catch;
+      req->callback->Call(Context::GetCurrent()->Global(), 3, argv);
+      req->callback.Dispose();
+
+      if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+      }
+    }
+
+    delete req;
+
+    // Close() waited for the flushed work requests.
+    if (--wrs_pending_ == 0 && closing_) {
+      StopPolling();
+    }
+
+    Unref();
   }
 
   static Handle<Value> ResizeCQ(const Arguments& args) {
@@ -131,71 +666,547 @@ private:
   static Handle<Value> QP(const Arguments& args) {
     HandleScope scope;
 
-    // (max_send_wr, max_recv_wr)
+    // (max_send_wr, max_recv_wr[, max_send_sge, max_recv_sge[, max_inline_data]])
     assert(args.Length() >= 2);
     assert(args[0]->IsInt32());
     assert(args[1]->IsInt32());
 
-    int num_cq = args[0]->Int32Value();
-
     IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
 
     struct ibv_qp_init_attr attr;
+    memset(&attr, 0, sizeof(attr));
 
     attr.send_cq = ibv->cq_;
     attr.recv_cq = ibv->cq_;
     attr.qp_type = IBV_QPT_RC;  // @fixme
+    attr.sq_sig_all = 0;        // See QueueSend()
 
     attr.cap.max_send_wr = args[0]->Uint32Value();
     attr.cap.max_recv_wr = args[1]->Uint32Value();
-    attr.cap.max_send_sge = 1;  // @fixme
-    attr.cap.max_recv_sge = 1;  // @fixme
-    // @note
-    // sqr, sq_sig_all, max_inline_data
-    ibv->qp_ = ibv_create_qp(ibv->pd_, &attr);
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+
+    if (args.Length() >= 4) {
+      assert(args[2]->IsInt32());
+      assert(args[3]->IsInt32());
+      attr.cap.max_send_sge = args[2]->Uint32Value();
+      attr.cap.max_recv_sge = args[3]->Uint32Value();
+    }
+
+    attr.cap.max_inline_data = IBV_DEFAULT_MAX_INLINE;
+    if (args.Length() >= 5) {
+      assert(args[4]->IsInt32());
+      attr.cap.max_inline_data = args[4]->Uint32Value();
+    }
+
+    // Devices do not report their inline limit, so ask for the requested
+    // size and halve it until the provider accepts.
+    for (;;) {
+      ibv->qp_ = ibv_create_qp(ibv->pd_, &attr);
+      if (ibv->qp_ || attr.cap.max_inline_data == 0) {
+        break;
+      }
+      attr.cap.max_inline_data /= 2;
+    }
     assert(ibv->qp_);
 
+    // The provider may round the capabilities up.
+    ibv->max_send_wr_ = attr.cap.max_send_wr;
+    ibv->max_inline_data_ = attr.cap.max_inline_data;
+    ibv->max_send_sge_ = attr.cap.max_send_sge;
+    ibv->max_recv_sge_ = attr.cap.max_recv_sge;
+
+    return Undefined();
   }
 
+  //
+  // (buffer, access_flag) -> { lkey, rkey, addr, length }
+  //
+  // Goes through the pin-down cache, so registering the same Buffer (or a
+  // slice of an already registered one) again is cheap. The returned object
+  // must be handed back to dereg_mr() when no longer needed.
+  //
   static Handle<Value> MR(const Arguments& args) {
     HandleScope scope;
 
     // (buffer, access_flag)
     assert(args.Length() >= 2);
-    assert(args[0]->IsObject());
+    assert(Buffer::HasInstance(args[0]));
     assert(args[1]->IsInt32());
 
-    Buffer *buffer = ObjectWrap::Unwrap<Buffer>(args[0]->ToObject());
+    Local<Object> buffer = args[0]->ToObject();
     int access_flag = args[1]->Int32Value();
 
     IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
 
-    struct ibv_qp_init_attr attr;
+    MRCache::Entry* e = ibv->mr_cache_.Acquire(ibv->pd_, buffer,
+        Buffer::Data(buffer), Buffer::Length(buffer), access_flag);
+    if (!e) {
+      return ThrowException(Exception::Error(
+          String::New("Failed to register memory region")));
+    }
 
-    // @todo { Check buffer's address is persistent during IB operation. }
-    ibv->mr_ = ibv_reg_mr(ibv->pd_, Buffer::Data(buffer), Buffer::Length(buffer), access_flag);
-    ibv->qp_ = ibv_create_qp(ibv->pd_, &attr);
-    assert(ibv->qp_);
+    ibv->mr_ = e->mr;
 
+    Local<Object> mr = mr_template->NewInstance();
+    mr->SetPointerInInternalField(0, e);
+    mr->Set(String::New("lkey"), Integer::NewFromUnsigned(e->mr->lkey));
+    mr->Set(String::New("rkey"), Integer::NewFromUnsigned(e->mr->rkey));
+    mr->Set(String::New("addr"), Number::New((double)(uintptr_t)Buffer::Data(buffer)));
+    mr->Set(String::New("length"), Integer::NewFromUnsigned(Buffer::Length(buffer)));
+
+    return scope.Close(mr);
   }
 
+  static Handle<Value> DeregMR(const Arguments& args) {
+    HandleScope scope;
+
+    // (mr)
+    assert(args.Length() >= 1);
+    assert(args[0]->IsObject());
+
+    Local<Object> mr = args[0]->ToObject();
+    MRCache::Entry* e = (MRCache::Entry*)mr->GetPointerFromInternalField(0);
+    assert(e);
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+
+    ibv->mr_cache_.Release(e);
+    mr->SetPointerInInternalField(0, NULL);
+
+    return Undefined();
+  }
+
+  static Handle<Value> SetMRCacheLimit(const Arguments& args) {
+    HandleScope scope;
+
+    // (max_pinned_bytes), 0 = no caching of idle MRs
+    assert(args.Length() >= 1);
+    assert(args[0]->IsNumber());
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+
+    ibv->mr_cache_.SetLimit((size_t)args[0]->IntegerValue());
+
+    return Undefined();
+  }
+
+  static Handle<Value> MRCacheStats(const Arguments& args) {
+    HandleScope scope;
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::New("hits"), Number::New((double)ibv->mr_cache_.hits()));
+    stats->Set(String::New("misses"), Number::New((double)ibv->mr_cache_.misses()));
+    stats->Set(String::New("evictions"), Number::New((double)ibv->mr_cache_.evictions()));
+    stats->Set(String::New("pinned_bytes"), Number::New((double)ibv->mr_cache_.pinned_bytes()));
+
+    return scope.Close(stats);
+  }
+
+  //
+  // Builds the SG list of a work request from a Buffer or an Array of
+  // Buffers (writev/readv style). `mrs` is a single mr() object covering
+  // every Buffer, or an Array with one per Buffer, or null for sends small
+  // enough to go inline; entries of the Array may be null as well.
+  // req->registered tells whether every Buffer got an MR. Returns false and
+  // throws when a Buffer is not covered by its MR.
+  //
+  // The Buffers are stored in req so they stay alive until the completion.
+  //
+  static bool BuildSGList(Handle<Value> bufs, Handle<Value> mrs,
+                          std::vector<struct ibv_sge>& sges, PendingWR *req) {
+    Local<Array> list;
+
+    if (bufs->IsArray()) {
+      // Copy, so later changes to the caller's array cannot drop a Buffer
+      // that is still in flight.
+      Local<Array> src = Local<Array>::Cast(bufs);
+      list = Array::New(src->Length());
+      for (uint32_t i = 0; i < src->Length(); i++) {
+        list->Set(i, src->Get(i));
+      }
+      req->buffer = Persistent<Object>::New(list);
+    } else {
+      list = Array::New(1);
+      list->Set(0, bufs);
+      req->buffer = Persistent<Object>::New(bufs->ToObject());
+    }
+
+    sges.resize(list->Length());
+    req->registered = true;
+
+    for (uint32_t i = 0; i < list->Length(); i++) {
+      Local<Value> buf = list->Get(i);
+      assert(Buffer::HasInstance(buf));
+
+      uintptr_t addr = (uintptr_t)Buffer::Data(buf->ToObject());
+      size_t length = Buffer::Length(buf->ToObject());
+
+      sges[i].addr    = addr;
+      sges[i].length  = length;
+      sges[i].lkey    = 0;
+
+      req->byte_len += length;
+
+      Local<Value> mr = mrs->IsArray() ? Local<Array>::Cast(mrs)->Get(i)
+                                       : Local<Value>::New(mrs);
+
+      // Inline sends may omit MRs; InlineFlags() checks they fit.
+      if (mr->IsNull() || mr->IsUndefined()) {
+        req->registered = false;
+        continue;
+      }
+      assert(mr->IsObject());
+
+      MRCache::Entry *e = (MRCache::Entry*)mr->ToObject()->GetPointerFromInternalField(0);
+      assert(e);
+
+      if (addr < e->start || addr + length > e->start + e->length) {
+        ThrowException(Exception::RangeError(
+            String::New("Buffer is not covered by the memory region")));
+        return false;
+      }
+
+      sges[i].lkey    = e->mr->lkey;
+    }
+
+    return true;
+  }
+
+  static PendingWR* NewPendingWR(const Arguments& args, int callback_index) {
+    PendingWR *req = new PendingWR();
+    req->byte_len = 0;
+    req->registered = false;
+
+    if (args.Length() > callback_index && args[callback_index]->IsFunction()) {
+      req->callback = Persistent<Function>::New(
+          Local<Function>::Cast(args[callback_index]));
+    }
+
+    return req;
+  }
+
+  static void DeletePendingWR(PendingWR *req) {
+    req->buffer.Dispose();
+    req->callback.Dispose();
+    delete req;
+  }
+
+  //
+  // (buffers, mrs[, callback])
+  //
+  // Sends a Buffer, or an Array of Buffers gathered into one work request,
+  // in place without copying. See BuildSGList() for `mrs`. The Buffers are
+  // held until the send completion is reaped, then passed to
+  // callback(status, byte_len, buffers).
+  //
   static Handle<Value> PostSend(const Arguments& args) {
     HandleScope scope;
 
-    // (buffer, access_flag)
     assert(args.Length() >= 2);
-    assert(args[0]->IsObject());
-    assert(args[1]->IsInt32());
 
     IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+    if (ibv->closing_) {
+      return ThrowException(Exception::Error(String::New("Device is closed")));
+    }
+
+    PendingWR *req = NewPendingWR(args, 2);
+
+    std::vector<struct ibv_sge> sges;
+    if (!BuildSGList(args[0], args[1], sges, req)) {
+      DeletePendingWR(req);
+      return Undefined();
+    }
+
+    if (sges.size() > ibv->max_send_sge_) {
+      DeletePendingWR(req);
+      return ThrowException(Exception::RangeError(
+          String::New("Too many Buffers for max_send_sge")));
+    }
+
+    int flags = 0;
+    if (!ibv->InlineFlags(req, &flags)) {
+      DeletePendingWR(req);
+      return ThrowException(Exception::RangeError(
+          String::New("Unregistered Buffers exceed max_inline_data")));
+    }
 
-    struct ibv_send_wr *wr; // @fixme
-    assert(0);  // @todo { implement }
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id      = (uintptr_t)req;
+    wr.opcode     = IBV_WR_SEND;
+    wr.send_flags = flags | ibv->QueueSend(req);
+    wr.sg_list    = sges.empty() ? NULL : &sges[0];
+    wr.num_sge    = sges.size();
 
     struct ibv_send_wr *bad_wr = NULL;
-    int ret = ibv_post_send(ibv->qp_, wr, &bad_wr);
-    assert(ret == 0);
+    int ret = ibv_post_send(ibv->qp_, &wr, &bad_wr);
+    if (ret) {
+      ibv->UnqueueSends(1);
+      DeletePendingWR(req);
+      return ThrowException(ErrnoException(ret, "ibv_post_send"));
+    }
+
+    // Stay alive until the completion releases the Buffers.
+    ibv->HoldWR();
+
+    return Undefined();
+  }
+
+  //
+  // (buffers, mrs[, callback])
+  //
+  // Posts a Buffer, or an Array of Buffers scattered into by one receive.
+  // callback(status, byte_len, buffers) runs when the receive completes.
+  //
+  static Handle<Value> PostRecv(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+    if (ibv->closing_) {
+      return ThrowException(Exception::Error(String::New("Device is closed")));
+    }
+
+    PendingWR *req = NewPendingWR(args, 2);
+
+    assert(args[1]->IsObject());
+
+    std::vector<struct ibv_sge> sges;
+    if (!BuildSGList(args[0], args[1], sges, req)) {
+      DeletePendingWR(req);
+      return Undefined();
+    }
+
+    if (sges.size() > ibv->max_recv_sge_) {
+      DeletePendingWR(req);
+      return ThrowException(Exception::RangeError(
+          String::New("Too many Buffers for max_recv_sge")));
+    }
+
+    // Receives never go inline.
+    if (!req->registered) {
+      DeletePendingWR(req);
+      return ThrowException(Exception::TypeError(
+          String::New("Every receive Buffer needs a memory region")));
+    }
+
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id      = (uintptr_t)req;
+    wr.sg_list    = sges.empty() ? NULL : &sges[0];
+    wr.num_sge    = sges.size();
+
+    struct ibv_recv_wr *bad_wr = NULL;
+    int ret = ibv_post_recv(ibv->qp_, &wr, &bad_wr);
+    if (ret) {
+      DeletePendingWR(req);
+      return ThrowException(ErrnoException(ret, "ibv_post_recv"));
+    }
+
+    ibv->HoldWR();
+
+    return Undefined();
+  }
+
+  //
+  // Builds one PendingWR and SG list per element of `list` for the batch
+  // posting calls. Element i is a Buffer or an Array of Buffers; `mrs` is a
+  // single mr() object or an Array with one entry (as for post_send) per
+  // element. Returns false, with nothing left allocated, on error.
+  //
+  static bool BuildBatch(const Arguments& args, uint32_t max_sge,
+                         std::vector<PendingWR*>& reqs,
+                         std::vector<std::vector<struct ibv_sge> >& sges) {
+    assert(args.Length() >= 2);
+    assert(args[0]->IsArray());
+
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    uint32_t n = list->Length();
+
+    reqs.resize(n);
+    sges.resize(n);
+
+    for (uint32_t i = 0; i < n; i++) {
+      Local<Value> mrs = args[1]->IsArray() ? Local<Array>::Cast(args[1])->Get(i)
+                                            : Local<Value>::New(args[1]);
+
+      reqs[i] = NewPendingWR(args, 2);
+
+      bool ok = BuildSGList(list->Get(i), mrs, sges[i], reqs[i]);
+      if (ok && sges[i].size() > max_sge) {
+        ThrowException(Exception::RangeError(
+            String::New("Too many Buffers for the QP's max_sge")));
+        ok = false;
+      }
 
+      if (!ok) {
+        for (uint32_t j = 0; j <= i; j++) {
+          DeletePendingWR(reqs[j]);
+        }
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  //
+  // (wrs, mrs[, callback]) -> number of WRs posted
+  //
+  // Posts every element of `wrs` (see BuildBatch()) as one chain of send
+  // WRs with a single ibv_post_send(). The return value equals wrs.length
+  // on success, otherwise it is the index of the WR reported in bad_wr;
+  // that WR and the ones after it were not posted. callback(status,
+  // byte_len, buffers) runs once per completed WR.
+  //
+  static Handle<Value> PostSendBatch(const Arguments& args) {
+    HandleScope scope;
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+    if (ibv->closing_) {
+      return ThrowException(Exception::Error(String::New("Device is closed")));
+    }
+
+    std::vector<PendingWR*> reqs;
+    std::vector<std::vector<struct ibv_sge> > sges;
+    if (!BuildBatch(args, ibv->max_send_sge_, reqs, sges)) {
+      return Undefined();
+    }
+
+    size_t n = reqs.size();
+    if (n == 0) {
+      return scope.Close(Integer::New(0));
+    }
+
+    std::vector<int> flags(n, 0);
+
+    for (size_t i = 0; i < n; i++) {
+      if (!ibv->InlineFlags(reqs[i], &flags[i])) {
+        for (size_t j = 0; j < n; j++) {
+          DeletePendingWR(reqs[j]);
+        }
+        return ThrowException(Exception::RangeError(
+            String::New("Unregistered Buffers exceed max_inline_data")));
+      }
+    }
+
+    std::vector<struct ibv_send_wr> wrs(n);
+    memset(&wrs[0], 0, n * sizeof(struct ibv_send_wr));
+
+    for (size_t i = 0; i < n; i++) {
+      wrs[i].wr_id      = (uintptr_t)reqs[i];
+      wrs[i].opcode     = IBV_WR_SEND;
+      wrs[i].send_flags = flags[i] | ibv->QueueSend(reqs[i]);
+      wrs[i].sg_list    = sges[i].empty() ? NULL : &sges[i][0];
+      wrs[i].num_sge    = sges[i].size();
+      wrs[i].next       = (i + 1 < n) ? &wrs[i + 1] : NULL;
+    }
+
+    struct ibv_send_wr *bad_wr = NULL;
+    int ret = ibv_post_send(ibv->qp_, &wrs[0], &bad_wr);
+
+    size_t posted = ret ? (size_t)(bad_wr - &wrs[0]) : n;
+
+    ibv->UnqueueSends(n - posted);
+
+    // If the posted part of the chain ends unsignaled, signal the next send
+    // so the tail still gets retired.
+    if (posted > 0 && posted < n && !(wrs[posted - 1].send_flags & IBV_SEND_SIGNALED)) {
+      ibv->sends_since_signal_ = ibv->signal_interval_;
+    }
+
+    for (size_t i = posted; i < n; i++) {
+      DeletePendingWR(reqs[i]);
+    }
+
+    for (size_t i = 0; i < posted; i++) {
+      ibv->HoldWR();
+    }
+
+    return scope.Close(Integer::New(posted));
+  }
+
+  //
+  // (wrs, mrs[, callback]) -> number of WRs posted
+  //
+  // Receive counterpart of post_send_batch().
+  //
+  static Handle<Value> PostRecvBatch(const Arguments& args) {
+    HandleScope scope;
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+    if (ibv->closing_) {
+      return ThrowException(Exception::Error(String::New("Device is closed")));
+    }
+
+    assert(args.Length() >= 2 && args[1]->IsObject());
+
+    std::vector<PendingWR*> reqs;
+    std::vector<std::vector<struct ibv_sge> > sges;
+    if (!BuildBatch(args, ibv->max_recv_sge_, reqs, sges)) {
+      return Undefined();
+    }
+
+    size_t n = reqs.size();
+    if (n == 0) {
+      return scope.Close(Integer::New(0));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      if (!reqs[i]->registered) {
+        for (size_t j = 0; j < n; j++) {
+          DeletePendingWR(reqs[j]);
+        }
+        return ThrowException(Exception::TypeError(
+            String::New("Every receive Buffer needs a memory region")));
+      }
+    }
+
+    std::vector<struct ibv_recv_wr> wrs(n);
+    memset(&wrs[0], 0, n * sizeof(struct ibv_recv_wr));
+
+    for (size_t i = 0; i < n; i++) {
+      wrs[i].wr_id      = (uintptr_t)reqs[i];
+      wrs[i].sg_list    = sges[i].empty() ? NULL : &sges[i][0];
+      wrs[i].num_sge    = sges[i].size();
+      wrs[i].next       = (i + 1 < n) ? &wrs[i + 1] : NULL;
+    }
+
+    struct ibv_recv_wr *bad_wr = NULL;
+    int ret = ibv_post_recv(ibv->qp_, &wrs[0], &bad_wr);
+
+    size_t posted = ret ? (size_t)(bad_wr - &wrs[0]) : n;
+
+    for (size_t i = posted; i < n; i++) {
+      DeletePendingWR(reqs[i]);
+    }
+
+    for (size_t i = 0; i < posted; i++) {
+      ibv->HoldWR();
+    }
+
+    return scope.Close(Integer::New(posted));
+  }
+
+  //
+  // (n) Signal every n-th send. 1 signals every send.
+  //
+  static Handle<Value> SetSignalInterval(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsUint32());
+
+    IBV *ibv = ObjectWrap::Unwrap<IBV>(args.This());
+
+    uint32_t n = args[0]->Uint32Value();
+    ibv->signal_interval_ = n > 0 ? n : 1;
+
+    return Undefined();
   }
 
   static Handle<Value> QueryDevice(const Arguments& args) {
@@ -341,8 +1352,12 @@ private:
       return args.Callee()->NewInstance();
     }
 
+    // ([device_name]), the first device by default
+    String::Utf8Value name(args[0]);
+    const char* device = args.Length() > 0 && args[0]->IsString() ? *name : NULL;
+
     try {
-      (new IBV())->Wrap(args.This());
+      (new IBV(device))->Wrap(args.This());
     } catch (const char* msg) {
       return ThrowException(Exception::Error(String::New(msg)));
     }
@@ -351,17 +1366,59 @@ private:
   }
 
 
-  IBV() {
+  IBV(const char* device) : ctx_(NULL), pd_(NULL), cq_(NULL), qp_(NULL),
+          comp_channel_(NULL), mr_(NULL), polling_(false), closing_(false),
+          wrs_pending_(0),
+          max_send_sge_(1), max_recv_sge_(1), max_send_wr_(1),
+          signal_interval_(1), sends_since_signal_(0), signaled_outstanding_(0),
+          max_inline_data_(0) {
+
+    int num_devices = 0;
+    struct ibv_device** list = ibv_get_device_list(&num_devices);
+    if (!list) {
+      throw "Failed to get the IB device list";
+    }
+
+    for (int i = 0; i < num_devices; i++) {
+      if (!device || strcmp(ibv_get_device_name(list[i]), device) == 0) {
+        ctx_ = ibv_open_device(list[i]);
+        break;
+      }
+    }
+
+    ibv_free_device_list(list);
+
+    if (!ctx_) {
+      throw "No such IB device, or it could not be opened";
+    }
   }
 
   ~IBV() {
     int ret;
 
-    if (pd_) {
-      ret = ibv_dealloc_pd(pd_);
+    // Polling holds a reference, so the handle is closed by now.
+    assert(!polling_);
+
+    // Teardown runs in the reverse order of creation: the QP goes first, as
+    // the CQ and the PD cannot be destroyed while it uses them. MRs go
+    // before the PD they were registered on.
+    if (qp_) {
+      ret = ibv_destroy_qp(qp_);
       assert(ret == 0);
     }
 
+    // Sends which will never complete now. No callbacks from a GC pass.
+    while (!send_queue_.empty()) {
+      PendingWR *req = send_queue_.front();
+      send_queue_.pop_front();
+
+      req->buffer.Dispose();
+      req->callback.Dispose();
+      delete req;
+    }
+
+    mr_cache_.Clear();
+
     if (cq_) {
       ret = ibv_destroy_cq(cq_);
       assert(ret == 0);
@@ -372,6 +1429,11 @@ private:
       assert(ret == 0);
     }
 
+    if (pd_) {
+      ret = ibv_dealloc_pd(pd_);
+      assert(ret == 0);
+    }
+
     if (ctx_) {
       ret = ibv_close_device(ctx_);
       assert(ret == 0);
@@ -385,10 +1447,34 @@ private:
   struct ibv_cq *cq_;
   struct ibv_qp *qp_;
   struct ibv_comp_channel *comp_channel_;
-  struct ibv_mr *mr_; // @fixme
+  struct ibv_mr *mr_; // @fixme { Last registered MR. }
+
+  MRCache mr_cache_;
+
+  uv_poll_t poll_handle_;   // Watches comp_channel_->fd
+  bool polling_;
+  bool closing_;            // close() was called
+  uint32_t wrs_pending_;    // Posted and not yet passed to Complete()
+
+  uint32_t max_send_sge_;
+  uint32_t max_recv_sge_;
+
+  // Selective signaling, see QueueSend().
+  uint32_t max_send_wr_;
+  uint32_t signal_interval_;
+  uint32_t sends_since_signal_;
+  uint32_t signaled_outstanding_;       // Signaled sends not yet retired
+  std::deque<PendingWR*> send_queue_;   // Posted sends, oldest first
+
+  uint32_t max_inline_data_;    // As granted at QP creation
 
 };
 
+// Called from the rdma_cm module init, see rdma_cm_wrap.cc.
+void InitializeIBV(Handle<Object> target) {
+  IBV::Initialize(target);
+}
+
 
 // Notes
 // - ibv_devinfo
@@ -403,4 +1489,3 @@ private:
 // - ibv_sge
 // - ibv_send_wr
 // - ibv_recv_wr
-
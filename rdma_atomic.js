@@ -0,0 +1,131 @@
+// Coordination primitives on top of remote 64-bit words, using the
+// fetch_add()/cmp_swap() atomics of an RDMAConnection handle
+// (build/Release/rdma). The words live in the memory the peer exposed with
+// expose(); they are addressed by their 8-byte aligned offset in it.
+//
+// Every operation is one network round-trip; retries are issued from the
+// completion callback, so waiting never blocks the event loop. Contended
+// retries back off, see Backoff.
+
+// Retries sent right away before backing off.
+var SPIN_RETRIES = 4;
+
+// Bounds in ms of the randomized delay between later retries.
+var MIN_BACKOFF = 1;
+var MAX_BACKOFF = 64;
+
+// Decodes the 64-bit value an atomic returned. Exact up to 2^53.
+function readU64(buf) {
+  return buf.readUInt32LE(0) + buf.readUInt32LE(4) * 0x100000000;
+}
+
+// Encodes a non-negative integer up to 2^53 as an atomic operand.
+function u64(n) {
+  return [Math.floor(n / 0x100000000), n >>> 0];
+}
+
+//
+// Bounded exponential backoff with full jitter. A waiter which keeps
+// losing retries at most every MAX_BACKOFF ms instead of flooding the
+// peer's HCA with atomics.
+//
+function Backoff() {
+  this.attempts = 0;
+}
+
+Backoff.prototype.retry = function(fn) {
+  var n = this.attempts++;
+  if (n < SPIN_RETRIES) return fn();
+
+  var delay = Math.min(MAX_BACKOFF, MIN_BACKOFF * Math.pow(2, n - SPIN_RETRIES));
+  setTimeout(fn, Math.random() * delay);
+};
+
+//
+// Lock word at `offset`: 0 = free, 1 = held.
+//
+function SpinLock(conn, offset) {
+  this.conn = conn;
+  this.offset = offset;
+}
+
+SpinLock.prototype.lock = function(cb) {
+  var self = this;
+  var backoff = new Backoff();
+
+  function attempt() {
+    self.conn.cmp_swap(self.offset, 0, 1, function(status, prev) {
+      if (status !== 0) return cb(new Error('cmp_swap failed: ' + status));
+      if (readU64(prev) === 0) return cb(null);
+      backoff.retry(attempt);
+    });
+  }
+
+  attempt();
+};
+
+SpinLock.prototype.unlock = function(cb) {
+  this.conn.cmp_swap(this.offset, 1, 0, function(status) {
+    if (cb) cb(status === 0 ? null : new Error('cmp_swap failed: ' + status));
+  });
+};
+
+//
+// FIFO lock. The word at `offset` holds the next ticket, the one at
+// `offset + 8` the ticket being served; both start at 0.
+//
+function TicketLock(conn, offset) {
+  this.conn = conn;
+  this.offset = offset;
+}
+
+TicketLock.prototype.lock = function(cb) {
+  var self = this;
+
+  this.conn.fetch_add(this.offset, 1, function(status, prev) {
+    if (status !== 0) return cb(new Error('fetch_add failed: ' + status));
+    self._wait(readU64(prev), new Backoff(), cb);
+  });
+};
+
+TicketLock.prototype._wait = function(ticket, backoff, cb) {
+  var self = this;
+
+  // fetch_add(0) reads the word atomically with respect to unlock().
+  this.conn.fetch_add(this.offset + 8, 0, function(status, prev) {
+    if (status !== 0) return cb(new Error('fetch_add failed: ' + status));
+    if (readU64(prev) === ticket) return cb(null);
+    backoff.retry(function() { self._wait(ticket, backoff, cb); });
+  });
+};
+
+TicketLock.prototype.unlock = function(cb) {
+  this.conn.fetch_add(this.offset + 8, 1, function(status) {
+    if (cb) cb(status === 0 ? null : new Error('fetch_add failed: ' + status));
+  });
+};
+
+//
+// Shared counter at `offset`. next() hands out distinct sequence numbers
+// to every worker.
+//
+function SeqCounter(conn, offset) {
+  this.conn = conn;
+  this.offset = offset;
+}
+
+// cb(err, previous_value)
+SeqCounter.prototype.add = function(n, cb) {
+  this.conn.fetch_add(this.offset, u64(n), function(status, prev) {
+    if (status !== 0) return cb(new Error('fetch_add failed: ' + status));
+    cb(null, readU64(prev));
+  });
+};
+
+SeqCounter.prototype.next = function(cb) {
+  this.add(1, cb);
+};
+
+exports.SpinLock = SpinLock;
+exports.TicketLock = TicketLock;
+exports.SeqCounter = SeqCounter;
@@ -7,12 +7,17 @@
 // node.js and v8
 #include <v8.h>
 #include <node.h>
+#include <uv.h>
 
 // C/C++
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <cerrno>
+
+// POSIX
+#include <fcntl.h>
 
 // RDMA CM
 #include <rdma/rdma_cma.h>
@@ -26,6 +31,35 @@ Persistent<Function> rdma_cmConstructor;
 static Persistent<String> family_symbol;
 static Persistent<String> address_symbol;
 static Persistent<String> port_symbol;
+static Persistent<String> id_symbol;
+static Persistent<String> listen_id_symbol;
+static Persistent<String> status_symbol;
+static Persistent<String> event_symbol;
+
+// Wraps a struct rdma_cm_id* for JS. Internal field 0 holds the pointer.
+static Persistent<ObjectTemplate> cm_id_template;
+
+//
+// Event names emitted to JS, indexed by enum rdma_cm_event_type.
+//
+static const char* cm_event_names[] = {
+  "addr_resolved",
+  "addr_error",
+  "route_resolved",
+  "route_error",
+  "connect_request",
+  "connect_response",
+  "connect_error",
+  "unreachable",
+  "rejected",
+  "established",
+  "disconnected",
+  "device_removal",
+  "multicast_join",
+  "multicast_error",
+  "addr_change",
+  "timewait_exit"
+};
 
 class RDMA_CM : public node::ObjectWrap {
 public:
@@ -76,28 +110,147 @@ public:
 
     rdma_cmConstructor = Persistent<Function>::New(t->GetFunction());
 
+    id_symbol = NODE_PSYMBOL("id");
+    listen_id_symbol = NODE_PSYMBOL("listen_id");
+    status_symbol = NODE_PSYMBOL("status");
+    event_symbol = NODE_PSYMBOL("event");
+
+    cm_id_template = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+    cm_id_template->SetInternalFieldCount(1);
+
     target->Set(String::NewSymbol("RDMA_CM"), rdma_cmConstructor);
 
   }
 
 private:
 
+  //
+  // ([watch]) Creates the event channel and, unless watch is false, starts
+  // watching its fd from the loop. CM events are then emitted on this
+  // object, e.g. this.emit('established', { event, status, id, listen_id }).
+  // An unwatched channel is read with get_cm_event() instead. There is one
+  // channel per object; destroy_event_channel() before creating another.
+  //
   static Handle<Value> CreateEventChannel(const Arguments& args) {
     HandleScope scope;
 
     RDMA_CM *rdma_cm = ObjectWrap::Unwrap<RDMA_CM>(args.This());
 
+    if (rdma_cm->event_channel_) {
+      return ThrowException(Exception::Error(String::New(
+          "Event channel already exists")));
+    }
+
     rdma_cm->event_channel_ = rdma_create_event_channel();
-    assert(rdma_cm->event_channel_);
+    if (!rdma_cm->event_channel_) {
+      return ThrowException(node::ErrnoException(errno, "rdma_create_event_channel"));
+    }
+
+    int fd = rdma_cm->event_channel_->fd;
+
+    int flags = fcntl(fd, F_GETFL);
+    assert(flags >= 0);
+    int ret = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    assert(ret == 0);
+
+    if (args.Length() >= 1 && !args[0]->IsUndefined() && !args[0]->BooleanValue()) {
+      return Undefined();
+    }
+
+    // A handle of a destroyed channel may still be closing, so every
+    // channel gets a fresh one.
+    rdma_cm->poll_handle_ = new uv_poll_t;
+
+    ret = uv_poll_init(uv_default_loop(), rdma_cm->poll_handle_, fd);
+    assert(ret == 0);
+    rdma_cm->poll_handle_->data = rdma_cm;
 
+    ret = uv_poll_start(rdma_cm->poll_handle_, UV_READABLE, OnEventChannelReadable);
+    assert(ret == 0);
+
+    // Keep the object alive while its channel is being watched.
+    rdma_cm->Ref();
+
+    return Undefined();
+  }
+
+  // The object may only go once libuv is done with the handle.
+  static void OnPollClosed(uv_handle_t* handle) {
+    RDMA_CM *rdma_cm = (RDMA_CM*)handle->data;
+    delete (uv_poll_t*)handle;
+    rdma_cm->Unref();
   }
 
   static Handle<Value> DestroyEventChannel(const Arguments& args) {
+    HandleScope scope;
 
     RDMA_CM *rdma_cm = ObjectWrap::Unwrap<RDMA_CM>(args.This());
 
-    rdma_destroy_id(rdma_cm->id_);
+    if (rdma_cm->id_) {
+      rdma_destroy_id(rdma_cm->id_);
+      rdma_cm->id_ = NULL;
+    }
+
+    if (rdma_cm->event_channel_) {
+      if (rdma_cm->poll_handle_) {
+        uv_poll_stop(rdma_cm->poll_handle_);
+        uv_close((uv_handle_t*)rdma_cm->poll_handle_, OnPollClosed);
+        rdma_cm->poll_handle_ = NULL;
+      }
+
+      rdma_destroy_event_channel(rdma_cm->event_channel_);
+      rdma_cm->event_channel_ = NULL;
+    }
 
+    return Undefined();
+  }
+
+  static Local<Object> WrapCMID(struct rdma_cm_id* id) {
+    HandleScope scope;
+
+    Local<Object> obj = cm_id_template->NewInstance();
+    obj->SetPointerInInternalField(0, id);
+
+    return scope.Close(obj);
+  }
+
+  //
+  // Consumes every pending CM event without blocking the loop.
+  //
+  static void OnEventChannelReadable(uv_poll_t* handle, int status, int events) {
+    HandleScope scope;
+
+    RDMA_CM *rdma_cm = (RDMA_CM*)handle->data;
+    struct rdma_cm_event *event;
+
+    if (status < 0) {
+      fprintf(stderr, "Failed to poll rdma_cm event channel\n");
+      return;
+    }
+
+    while (rdma_cm->event_channel_ &&
+           rdma_get_cm_event(rdma_cm->event_channel_, &event) == 0) {
+
+      Local<Object> info = Object::New();
+      info->Set(event_symbol, Integer::New(event->event));
+      info->Set(status_symbol, Integer::New(event->status));
+      info->Set(id_symbol, WrapCMID(event->id));
+      if (event->listen_id) {
+        info->Set(listen_id_symbol, WrapCMID(event->listen_id));
+      }
+
+      const char* name = "unknown";
+      if ((size_t)event->event < sizeof(cm_event_names) / sizeof(cm_event_names[0])) {
+        name = cm_event_names[event->event];
+      }
+
+      // Everything JS needs has been copied out, so the event can be
+      // released before emitting.
+      rdma_ack_cm_event(event);
+
+      Local<Value> argv[2] = { String::New(name), info };
+      node::MakeCallback(rdma_cm->handle_, "emit", 2, argv);
+    }
   }
 
   static Handle<Value> CreateID(const Arguments& args) {
@@ -141,10 +294,20 @@ private:
 
     RDMA_CM *rdma_cm = ObjectWrap::Unwrap<RDMA_CM>(args.This());
 
+    // The watcher consumes every event as it arrives.
+    if (rdma_cm->poll_handle_) {
+      return ThrowException(Exception::Error(String::New(
+          "get_cm_event() is not available on a watched event channel")));
+    }
+
+    // The channel is non-blocking; null means no event is pending.
     int ret = rdma_get_cm_event(rdma_cm->event_channel_, &rdma_cm->event_);
-    assert(ret == 0);
+    if (ret) {
+      assert(errno == EAGAIN);
+      return Null();
+    }
 
-    return scope.Close(Integer::New(ret));
+    return scope.Close(Integer::New(rdma_cm->event_->event));
   }
 
   static Handle<Value> AckCMEvent(const Arguments& args) {
@@ -152,25 +315,12 @@ private:
 
     RDMA_CM *rdma_cm = ObjectWrap::Unwrap<RDMA_CM>(args.This());
 
-    // ("addr", "port")
-    assert(args.Length() >= 2);
-    assert(args[0]->IsString());
-    assert(args[1]->IsString());
-
-    String::AsciiValue ip_address(args[0]->ToString());
-    String::AsciiValue port_str(args[1]->ToString());
-
-    struct addrinfo *addr;
-
-    int ret = getaddrinfo(*ip_address, *port_str, NULL, &addr);
-    assert(ret == 0);
-
-    int timeout_ms = 500; // 0.5 sec. @fixme
-    ret = rdma_resolve_addr(rdma_cm->id_, NULL, addr->ai_addr, timeout_ms);
-    assert(ret == 0);
-
-    freeaddrinfo(addr);
+    if (rdma_cm->event_) {
+      rdma_ack_cm_event(rdma_cm->event_);
+      rdma_cm->event_ = NULL;
+    }
 
+    return Undefined();
   }
 
   static Handle<Value> ResolveRoute(const Arguments& args) {
@@ -202,7 +352,7 @@ private:
   }
 
 
-  RDMA_CM() : id_(0), event_channel_(0), event_(0) {
+  RDMA_CM() : id_(0), event_channel_(0), event_(0), poll_handle_(0) {
   }
 
   ~RDMA_CM() {
@@ -216,6 +366,8 @@ private:
   struct rdma_event_channel *event_channel_;
   struct rdma_cm_event      *event_;
 
+  uv_poll_t                 *poll_handle_;  // Watches event_channel_->fd, NULL if unwatched
+
 };
 
 //
@@ -231,6 +383,14 @@ private:
 //  - ibv_pd
 //  - ibv_event_type
 
+// ibv_wrap.cc
+void InitializeIBV(Handle<Object> target);
+
+static void Initialize(Handle<Object> target) {
+  RDMA_CM::Initialize(target);
+  InitializeIBV(target);
+}
+
 extern "C" {
-NODE_MODULE(rdma_cm, RDMA_CM::Initialize);
+NODE_MODULE(rdma_cm, Initialize);
 }
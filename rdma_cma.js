@@ -1,15 +1,8 @@
-var RDMA_CMA = require('./build/Release/rdma_cma').RDMA_CMA;
+var EventEmitter = require('events').EventEmitter;
+var RDMA_CM = require('./build/Release/rdma_cm').RDMA_CM;
 
-// rdma_create_event_channel
-// return: event_channel
-var create_event_channel = function() {
-  channel = RDMA_CMA.rdma_create_event_channel();
-}
+// CM events are emitted by the native event channel watcher:
+//   cm.on('connect_request', function(ev) { ... ev.id ... })
+RDMA_CM.prototype.__proto__ = EventEmitter.prototype;
 
-var destroy_event_channel = function(channel) {
-  RDMA_CMA.rdma_destroy_event_channel(channel);
-}
-
-var destroy_event_channel = function(channel) {
-  RDMA_CMA.rdma_destroy_event_channel(channel);
-}
+exports.RDMA_CM = RDMA_CM;
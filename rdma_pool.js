@@ -0,0 +1,422 @@
+var Duplex = require('stream').Duplex;
+var EventEmitter = require('events').EventEmitter;
+var util = require('util');
+
+// Client connection pool with stream multiplexing over RDMAConnection
+// handles (build/Release/rdma).
+//
+// Connection setup costs an address resolve, a route resolve and a CM
+// handshake, i.e. milliseconds. A Pool keeps established connections per
+// (host, port) and runs many short-lived logical streams over each one.
+// Every frame on the wire carries a stream id:
+//
+//   uint32 stream id | uint8 type | uint32 payload length | payload
+//
+// all little-endian. Clients open odd ids; a Session accepting streams
+// (see accept()) learns them from the first frame.
+//
+// Flow control is per connection (credits, see rdma_wrap.cc): streams have
+// no window of their own, so a stream which is not read keeps buffering.
+
+var HEADER_SIZE = 9;
+
+var FRAME_DATA = 0;
+var FRAME_END = 1;      // No more data from the sender on this stream
+var FRAME_RESET = 2;    // The stream was destroyed
+
+function MuxStream(session, id, options) {
+  Duplex.call(this, options);
+
+  var self = this;
+
+  this.id = id;
+  this._session = session;
+  this._ended = false;      // Peer sent FRAME_END
+  this._finished = false;   // We sent FRAME_END
+
+  this.once('finish', function() {
+    self._finished = true;
+    if (self._session) self._session._send(self.id, FRAME_END, null, null);
+    self._maybeRelease();
+  });
+}
+util.inherits(MuxStream, Duplex);
+
+MuxStream.prototype._write = function(chunk, encoding, cb) {
+  if (!this._session) return cb(new Error('Stream is closed'));
+  this._session._send(this.id, FRAME_DATA, chunk, cb);
+};
+
+MuxStream.prototype._read = function(size) {
+  // Data is pushed as frames arrive, see the note on flow control above.
+};
+
+MuxStream.prototype._onEnd = function() {
+  this._ended = true;
+  this.push(null);
+  this._maybeRelease();
+};
+
+MuxStream.prototype._maybeRelease = function() {
+  if (this._ended && this._finished && this._session) {
+    this._session._release(this);
+    this._session = null;
+    this.emit('close');
+  }
+};
+
+MuxStream.prototype.destroy = function(err) {
+  var session = this._session;
+  if (!session) return;
+
+  this._session = null;
+  session._send(this.id, FRAME_RESET, null, null);
+  session._release(this);
+
+  if (err) this.emit('error', err);
+  this.emit('close');
+};
+
+MuxStream.prototype._onReset = function(err) {
+  if (!this._session) return;
+  this._session = null;
+
+  if (err) this.emit('error', err);
+  this.emit('close');
+};
+
+//
+// Multiplexes streams over one connection handle. Emits 'stream' for
+// streams opened by the peer, 'idle' when the last stream is released and
+// 'close' when the connection is gone.
+//
+function Session(handle, options) {
+  EventEmitter.call(this);
+
+  var self = this;
+
+  this._handle = handle;
+  this._options = options || {};
+  this._streams = {};
+  this.numStreams = 0;
+  this._nextId = 1;
+  this._queue = [];         // Frames waiting for the connection to drain
+  this._blocked = false;
+  this._pendingCallback = null;
+  this._rx = null;          // Partial frame
+
+  handle.ondata = function(buf) {
+    self._onData(buf);
+  };
+
+  handle.ondrain = function() {
+    var cb = self._pendingCallback;
+    self._pendingCallback = null;
+    self._blocked = false;
+    if (cb) cb();
+    self._flush();
+  };
+
+  handle.onend = function() {
+    // The peer will not send any more frames.
+    self._resetAll(null);
+    handle.shutdown();
+  };
+
+  handle.onclose = function() {
+    self._handle = null;
+
+    // Frames waiting for ondrain() will never see it; _flush() fails the
+    // queued ones.
+    var cb = self._pendingCallback;
+    self._pendingCallback = null;
+    self._blocked = false;
+    if (cb) cb(new Error('Connection closed'));
+    self._flush();
+
+    self._resetAll(new Error('Connection closed'));
+    self.emit('close');
+  };
+}
+util.inherits(Session, EventEmitter);
+
+Session.prototype.open = function() {
+  if (!this._handle) throw new Error('Connection is closed');
+
+  var id = this._nextId;
+  this._nextId += 2;
+
+  return this._add(id);
+};
+
+Session.prototype.close = function() {
+  if (this._handle) this._handle.disconnect();
+};
+
+Session.prototype._add = function(id) {
+  var stream = new MuxStream(this, id, this._options);
+  this._streams[id] = stream;
+  this.numStreams++;
+  return stream;
+};
+
+Session.prototype._release = function(stream) {
+  if (this._streams[stream.id] !== stream) return;
+
+  delete this._streams[stream.id];
+  this.numStreams--;
+
+  if (this.numStreams === 0) this.emit('idle');
+};
+
+Session.prototype._resetAll = function(err) {
+  var streams = this._streams;
+  this._streams = {};
+  this.numStreams = 0;
+
+  for (var id in streams) {
+    streams[id]._onReset(err);
+  }
+};
+
+Session.prototype._send = function(id, type, payload, cb) {
+  var len = payload ? payload.length : 0;
+  var header = new Buffer(HEADER_SIZE);
+
+  header.writeUInt32LE(id, 0);
+  header.writeUInt8(type, 4);
+  header.writeUInt32LE(len, 5);
+
+  var frame = len ? Buffer.concat([header, payload], HEADER_SIZE + len) : header;
+
+  this._queue.push({ frame: frame, cb: cb });
+  this._flush();
+};
+
+Session.prototype._flush = function() {
+  while (!this._blocked && this._queue.length > 0) {
+    var item = this._queue.shift();
+
+    if (!this._handle) {
+      if (item.cb) item.cb(new Error('Connection closed'));
+      continue;
+    }
+
+    if (this._handle.write(item.frame)) {
+      if (item.cb) item.cb();
+    } else {
+      // Accepted, but later frames wait for ondrain().
+      this._blocked = true;
+      this._pendingCallback = item.cb;
+    }
+  }
+};
+
+Session.prototype._onData = function(buf) {
+  if (this._rx) {
+    buf = Buffer.concat([this._rx, buf]);
+    this._rx = null;
+  }
+
+  var off = 0;
+
+  while (buf.length - off >= HEADER_SIZE) {
+    var id = buf.readUInt32LE(off);
+    var type = buf.readUInt8(off + 4);
+    var len = buf.readUInt32LE(off + 5);
+
+    if (buf.length - off < HEADER_SIZE + len) break;
+
+    var payload = buf.slice(off + HEADER_SIZE, off + HEADER_SIZE + len);
+    off += HEADER_SIZE + len;
+
+    this._onFrame(id, type, payload);
+  }
+
+  if (off < buf.length) this._rx = buf.slice(off);
+};
+
+Session.prototype._onFrame = function(id, type, payload) {
+  var stream = this._streams[id];
+
+  if (!stream) {
+    // Frames of streams we already destroyed are dropped.
+    if (type === FRAME_RESET || !this._options.accept) return;
+
+    stream = this._add(id);
+    this.emit('stream', stream);
+  }
+
+  switch (type) {
+  case FRAME_DATA:
+    stream.push(payload);
+    break;
+  case FRAME_END:
+    stream._onEnd();
+    break;
+  case FRAME_RESET:
+    this._release(stream);
+    stream._onReset(new Error('Stream reset by peer'));
+    break;
+  }
+};
+
+//
+// Pool of client connections over an RDMA object (build/Release/rdma).
+//
+// options:
+//   maxConnections  Connections per (host, port), default 4
+//   maxStreams      Streams per connection before another one is opened,
+//                   default 256. With every connection at the limit new
+//                   streams go to the least loaded one.
+//   idleTimeout     ms before a connection without streams is closed,
+//                   0 (default) keeps it open
+//
+function Pool(rdma, options) {
+  if (!(this instanceof Pool)) return new Pool(rdma, options);
+  EventEmitter.call(this);
+
+  options = options || {};
+
+  this._rdma = rdma;
+  this.maxConnections = options.maxConnections || 4;
+  this.maxStreams = options.maxStreams || 256;
+  this.idleTimeout = options.idleTimeout || 0;
+
+  this._entries = {};       // 'host:port' -> { sessions, connecting, waiters }
+}
+util.inherits(Pool, EventEmitter);
+
+//
+// cb(err, stream) with a new stream to host:port.
+//
+Pool.prototype.stream = function(host, port, cb) {
+  var key = host + ':' + port;
+  var entry = this._entries[key];
+
+  if (!entry) {
+    entry = this._entries[key] = { sessions: [], connecting: 0, waiters: [] };
+  }
+
+  var best = null;
+  for (var i = 0; i < entry.sessions.length; i++) {
+    var s = entry.sessions[i];
+    if (!best || s.numStreams < best.numStreams) best = s;
+  }
+
+  if (best && best.numStreams < this.maxStreams) {
+    return this._open(best, cb);
+  }
+
+  // Connections being set up will take maxStreams waiters each.
+  if (entry.waiters.length < entry.connecting * this.maxStreams) {
+    return entry.waiters.push(cb);
+  }
+
+  if (entry.sessions.length + entry.connecting < this.maxConnections) {
+    entry.waiters.push(cb);
+    return this._connect(entry, host, port);
+  }
+
+  // At the limit: wait for a connection being set up, if any.
+  if (!best || entry.connecting > 0) return entry.waiters.push(cb);
+
+  this._open(best, cb);
+};
+
+//
+// Closes every pooled connection.
+//
+Pool.prototype.close = function() {
+  for (var key in this._entries) {
+    var sessions = this._entries[key].sessions;
+    for (var i = 0; i < sessions.length; i++) {
+      sessions[i].close();
+    }
+  }
+};
+
+Pool.prototype._open = function(session, cb) {
+  if (session._idleTimer) {
+    clearTimeout(session._idleTimer);
+    session._idleTimer = null;
+  }
+
+  var stream;
+  try {
+    stream = session.open();
+  } catch (e) {
+    return process.nextTick(function() { cb(e); });
+  }
+
+  process.nextTick(function() { cb(null, stream); });
+};
+
+Pool.prototype._connect = function(entry, host, port) {
+  var self = this;
+
+  entry.connecting++;
+
+  try {
+    this._rdma.client(host, port, onConnect);
+  } catch (e) {
+    process.nextTick(function() { onConnect(e.errno ? -e.errno : -1, null); });
+  }
+
+  function onConnect(status, handle) {
+    entry.connecting--;
+
+    if (status !== 0) {
+      var err = new Error('connect failed, errno ' + (-status));
+      err.errno = -status;
+
+      // Waiters beyond what the remaining connects will serve fail now.
+      var waiters = entry.waiters.splice(0, entry.waiters.length);
+      for (var i = 0; i < waiters.length; i++) {
+        if (entry.sessions.length > 0 || entry.connecting > 0) {
+          self.stream(host, port, waiters[i]);
+        } else {
+          waiters[i](err);
+        }
+      }
+      return;
+    }
+
+    var session = new Session(handle);
+    entry.sessions.push(session);
+
+    session.on('close', function() {
+      var i = entry.sessions.indexOf(session);
+      if (i >= 0) entry.sessions.splice(i, 1);
+      if (session._idleTimer) clearTimeout(session._idleTimer);
+    });
+
+    session.on('idle', function() {
+      if (!self.idleTimeout) return;
+      session._idleTimer = setTimeout(function() {
+        session._idleTimer = null;
+        if (session.numStreams === 0) session.close();
+      }, self.idleTimeout);
+    });
+
+    var waiters = entry.waiters.splice(0, entry.waiters.length);
+    for (var j = 0; j < waiters.length; j++) {
+      self.stream(host, port, waiters[j]);
+    }
+  }
+};
+
+//
+// Serves streams on an accepted connection handle (RDMA onconnection):
+// the returned Session emits 'stream' for every stream a client opens.
+//
+function accept(handle, options) {
+  options = util._extend({}, options);
+  options.accept = true;
+  return new Session(handle, options);
+}
+
+exports.Pool = Pool;
+exports.Session = Session;
+exports.MuxStream = MuxStream;
+exports.accept = accept;
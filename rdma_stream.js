@@ -0,0 +1,62 @@
+var Duplex = require('stream').Duplex;
+var util = require('util');
+
+// Duplex stream over an RDMAConnection handle (build/Release/rdma).
+//
+// Back-pressure is end to end: a write which has to wait for peer credits,
+// ring space or send queue slots holds its callback until the handle's
+// ondrain(), and a reader whose push() buffer is full pauses the handle,
+// which stops returning credits so the peer's writes back up in turn.
+function RDMAStream(handle, options) {
+  if (!(this instanceof RDMAStream)) return new RDMAStream(handle, options);
+  Duplex.call(this, options);
+
+  var self = this;
+
+  this._handle = handle;
+  this._writeCallback = null;
+
+  handle.ondata = function(buf) {
+    if (!self.push(buf)) handle.pause();
+  };
+
+  handle.ondrain = function() {
+    var cb = self._writeCallback;
+    self._writeCallback = null;
+    if (cb) cb();
+  };
+
+  handle.onend = function() {
+    self.push(null);
+  };
+
+  handle.onclose = function() {
+    // A write waiting for ondrain() will never see it.
+    var cb = self._writeCallback;
+    self._writeCallback = null;
+    self._handle = null;
+    if (cb) cb(new Error('Connection closed'));
+    self.emit('close');
+  };
+
+  this.once('finish', function() {
+    if (self._handle) self._handle.shutdown();
+  });
+}
+util.inherits(RDMAStream, Duplex);
+
+RDMAStream.prototype._write = function(chunk, encoding, cb) {
+  if (!this._handle) return cb(new Error('Connection is closed'));
+
+  if (this._handle.write(chunk)) {
+    cb();
+  } else {
+    this._writeCallback = cb;
+  }
+};
+
+RDMAStream.prototype._read = function(size) {
+  if (this._handle) this._handle.resume();
+};
+
+exports.RDMAStream = RDMAStream;
@@ -7,61 +7,693 @@
 // node.js and v8
 #include <v8.h>
 #include <node.h>
+#include <node_buffer.h>
+#include <uv.h>
 
 // C/C++
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
+#include <cerrno>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
 
 // RDMA CM
 #include <rdma/rdma_cma.h>
 
 using namespace v8;
 
-static const int RDMA_BUFFER_SIZE   = 1024;
+//
+// Size of the RDMA-write ring each side exposes to its peer (see
+// RDMARingSend). Leased from the pool, so keep it a power of two.
+//
+static const int RDMA_RING_SIZE     = 64 * 1024;
+
+//
+// Hybrid completion polling. After a completion event the CQ is busy-polled
+// from the loop for up to `max_budget_ns` before notification is re-armed.
+// The actual budget follows the observed completion interarrival time, so a
+// slow CQ falls back to pure interrupt mode and never burns a core.
+//
+typedef struct
+{
+    uint64_t                    min_budget_ns;  ///< Lower bound while spinning
+    uint64_t                    max_budget_ns;  ///< 0 disables busy polling
+    int                         wc_batch;       ///< # of ibv_wc reaped per ibv_poll_cq()
+} RDMAPollConfig;
+
+static RDMAPollConfig g_poll_config = { 2000, 50000, 32 };  // 2 us, 50 us, 32 wc
+
+static const int RDMA_MAX_WC_BATCH  = 128;
+
+//
+// Queue pair capabilities used when connections create their QP.
+//
+typedef struct
+{
+    uint32_t                    max_send_wr;
+    uint32_t                    max_recv_wr;
+    uint32_t                    signal_interval;///< Request a completion every N sends
+    uint32_t                    max_inline_data;///< Requested; halved until the device accepts
+} RDMAQPConfig;
+
+static RDMAQPConfig g_qp_config = { 10, 10, 4, 256 };
+
+// CQ events are acknowledged in bulk; ibv_ack_cq_events() takes a lock.
+static const unsigned int RDMA_CQ_ACK_THRESHOLD = 64;
+
+//
+// Completion queues per device context. Each CQ gets its own completion
+// channel on comp_vector (i % num_comp_vectors), so interrupts are spread
+// over the vectors' cores, and connections are spread over the CQs. With
+// `workers` every CQ is polled by its own thread, optionally pinned to
+// cpus[i % cpus.size()]; completions are still handled on the loop.
+//
+typedef struct
+{
+    enum {
+        ASSIGN_LEAST_LOADED,    ///< CQ with the fewest connections
+        ASSIGN_HASH             ///< Hash of the peer address
+    } assign;
+
+    int                         num_cqs;
+    bool                        workers;
+    std::vector<int>*           cpus;           ///< Empty: no affinity
+} RDMACQConfig;
+
+static RDMACQConfig g_cq_config = { RDMACQConfig::ASSIGN_LEAST_LOADED, 1, false, NULL };
+
+static const int RDMA_MAX_CQS       = 64;
+
+class RDMA;
+
+//
+// Compact completion record handed to JS, one array per loop tick.
+//
+typedef struct
+{
+    int                         status;         ///< enum ibv_wc_status
+    int                         opcode;         ///< enum ibv_wc_opcode
+    uint32_t                    byte_len;
+    uint32_t                    qp_num;
+} RDMACompletion;
 
 typedef struct
 {
     enum {
         MSG_MR,
-        MSG_DONE
+        MSG_DONE,
+        MSG_CREDIT,     ///< Carries nothing but credits
+        MSG_RNDV_RTS,   ///< A registered payload is ready to be read
+        MSG_RNDV_FIN,   ///< The payload was read, the sender may reuse it
+        MSG_EXPOSE      ///< Memory the peer may access with one-sided operations
     } type;
 
+    uint32_t            credits;        ///< Receives the sender reposted since its last message
+    uint32_t            ring_consumed;  ///< Ring bytes the sender consumed since its last message
+
     union {
         struct ibv_mr mr;
+
+        struct {
+            uint64_t    addr;
+            uint32_t    rkey;
+            uint32_t    length;
+            uint64_t    cookie;     ///< Sender's handle, echoed by MSG_RNDV_FIN
+            int32_t     status;     ///< MSG_RNDV_FIN: 0 or -errno
+        } rndv;
+
+        struct {
+            uint64_t    addr;
+            uint32_t    rkey;
+            uint32_t    length;
+        } expose;
     } data;
 } RDMAMessage;
 
+//
+// Credit-based flow control for RDMAMessage. Each side starts with
+// RDMA_RECV_DEPTH credits, i.e. the receives its peer posted up front, and
+// spends one per message. Consumed receives are reposted and handed back to
+// the peer as credits, piggybacked on the next message or, once
+// RDMA_CREDIT_UPDATE_THRESHOLD of them are pending, as an explicit
+// MSG_CREDIT. Messages without a credit wait in a local backlog, so the
+// peer never sees a send without a posted receive (no RNR NAK retries).
+//
+// The last credit is reserved for messages which return credits, otherwise
+// two peers which have both run out could never tell each other about
+// freshly posted receives.
+//
+static const uint32_t RDMA_RECV_DEPTH               = 8;
+static const uint32_t RDMA_CREDIT_UPDATE_THRESHOLD  = RDMA_RECV_DEPTH / 2;
+
+//
+// Smallest send queue set_qp_caps() accepts. RDMASendQueueHasRoom() holds
+// one slot back for RDMAPostFlush(); the rest must fit a message, a credit
+// update and a rendezvous read at the same time.
+//
+static const uint32_t RDMA_MIN_SEND_WR              = 4;
+
+// Pending connection requests queued by rdma_listen() unless overridden.
+static const int      RDMA_DEFAULT_BACKLOG  = 1024;
+
+// Initial size of a device's shared CQ, see RDMAReserveCQ().
+static const int      RDMA_MIN_CQE          = 256;
+
+// wr_id of every send. Receives carry their pool buffer, which is never 0.
+static const uint64_t RDMA_SEND_WR_ID       = 0;
+
+//
+// Payloads above this size are not copied through the write ring. The
+// sender advertises its registered region in MSG_RNDV_RTS, the receiver
+// RDMA-READs it into the destination and answers with MSG_RNDV_FIN.
+//
+static const uint32_t RDMA_RNDV_THRESHOLD   = 16 * 1024;
+
+// Outstanding RDMA READs/atomics we accept as responder and issue as initiator.
+static const uint8_t  RDMA_RD_ATOMIC_DEPTH  = 4;
+
+//
+// Per-PD pool of pre-registered buffers in power-of-two size classes.
+//
+// Buffers are carved out of slabs which are registered once with
+// ibv_reg_mr() and never deregistered until the pool is destroyed, so
+// leasing and returning a buffer is a free-list operation. Every buffer
+// shares the lkey/rkey of its slab. On devices with memory windows the
+// slabs also allow binding them, see RDMAStartMWOp().
+//
+static const int    RDMA_POOL_MIN_SHIFT     = 6;            // 64 B
+static const int    RDMA_POOL_MAX_SHIFT     = 22;           // 4 MB
+static const int    RDMA_POOL_NUM_CLASSES   = RDMA_POOL_MAX_SHIFT - RDMA_POOL_MIN_SHIFT + 1;
+static const size_t RDMA_POOL_SLAB_SIZE     = 256 * 1024;   // Minimum bytes registered per refill
+
+static const int    RDMA_POOL_ACCESS        = IBV_ACCESS_LOCAL_WRITE |
+                                              IBV_ACCESS_REMOTE_WRITE |
+                                              IBV_ACCESS_REMOTE_READ |
+                                              IBV_ACCESS_REMOTE_ATOMIC;
+
+struct RDMABufferPool;
+
+typedef struct RDMABuffer
+{
+    void*                       addr;
+    size_t                      length;         ///< Capacity, i.e. the class size
+    struct ibv_mr*              mr;             ///< MR of the owning slab
+    int                         size_class;
+    struct RDMABufferPool*      pool;
+    struct RDMABuffer*          next;           ///< Free list link
+} RDMABuffer;
+
+typedef struct
+{
+    void*                       base;
+    struct ibv_mr*              mr;
+    RDMABuffer*                 buffers;        ///< Descriptors carved from this slab
+} RDMASlab;
+
+typedef struct
+{
+    uint64_t                    hits;           ///< Leases served from a free list
+    uint64_t                    misses;         ///< Leases which required a new slab
+    uint64_t                    pinned_bytes;   ///< Bytes registered by the pool
+    uint64_t                    leased_bytes;   ///< Bytes currently handed out
+} RDMAPoolStats;
+
+typedef struct RDMABufferPool
+{
+    struct ibv_pd*              pd;
+    int                         access;         ///< ibv_reg_mr() flags of the slabs
+    RDMABuffer*                 free_list[RDMA_POOL_NUM_CLASSES];
+    std::vector<RDMASlab>*      slabs;
+    RDMAPoolStats               stats;
+} RDMABufferPool;
+
+// Every live pool, for pool_stats().
+static std::vector<RDMABufferPool*> g_pools;
+
+static RDMABufferPool* RDMAPoolCreate(struct ibv_pd* pd, int access)
+{
+    RDMABufferPool* pool = (RDMABufferPool*)calloc(1, sizeof(RDMABufferPool));
+    pool->pd     = pd;
+    pool->access = access;
+    pool->slabs = new std::vector<RDMASlab>();
+
+    g_pools.push_back(pool);
+
+    return pool;
+}
+
+static void RDMAPoolDestroy(RDMABufferPool* pool)
+{
+    for (size_t i = 0; i < pool->slabs->size(); i++) {
+        RDMASlab& slab = (*pool->slabs)[i];
+        ibv_dereg_mr(slab.mr);
+        free(slab.base);
+        free(slab.buffers);
+    }
+
+    for (size_t i = 0; i < g_pools.size(); i++) {
+        if (g_pools[i] == pool) {
+            g_pools.erase(g_pools.begin() + i);
+            break;
+        }
+    }
+
+    delete pool->slabs;
+    free(pool);
+}
+
+static int RDMAPoolSizeClass(size_t length)
+{
+    int shift = RDMA_POOL_MIN_SHIFT;
+    while (((size_t)1 << shift) < length) {
+        shift++;
+    }
+
+    assert(shift <= RDMA_POOL_MAX_SHIFT);
+    return shift - RDMA_POOL_MIN_SHIFT;
+}
+
+//
+// Registers a new slab for the size class and threads its buffers onto the
+// free list.
+//
+static void RDMAPoolRefill(RDMABufferPool* pool, int size_class)
+{
+    size_t buf_size = (size_t)1 << (size_class + RDMA_POOL_MIN_SHIFT);
+    size_t slab_size = buf_size > RDMA_POOL_SLAB_SIZE ? buf_size : RDMA_POOL_SLAB_SIZE;
+    size_t count = slab_size / buf_size;
+
+    RDMASlab slab;
+
+    int ret = posix_memalign(&slab.base, 4096, slab_size);
+    assert(ret == 0);
+
+    slab.mr = ibv_reg_mr(pool->pd, slab.base, slab_size, pool->access);
+    if (!slab.mr) {
+        fprintf(stderr, "Failed to operate ibv_reg_mr()\n");
+        exit(-1);
+    }
+
+    slab.buffers = (RDMABuffer*)calloc(count, sizeof(RDMABuffer));
+
+    for (size_t i = 0; i < count; i++) {
+        RDMABuffer* buf = &slab.buffers[i];
+        buf->addr       = (char*)slab.base + i * buf_size;
+        buf->length     = buf_size;
+        buf->mr         = slab.mr;
+        buf->size_class = size_class;
+        buf->pool       = pool;
+        buf->next       = pool->free_list[size_class];
+        pool->free_list[size_class] = buf;
+    }
+
+    pool->slabs->push_back(slab);
+    pool->stats.pinned_bytes += slab_size;
+}
+
+//
+// Leases a registered buffer of at least `length` bytes.
+//
+static RDMABuffer* RDMAPoolGet(RDMABufferPool* pool, size_t length)
+{
+    int size_class = RDMAPoolSizeClass(length);
+
+    if (pool->free_list[size_class]) {
+        pool->stats.hits++;
+    } else {
+        pool->stats.misses++;
+        RDMAPoolRefill(pool, size_class);
+    }
+
+    RDMABuffer* buf = pool->free_list[size_class];
+    pool->free_list[size_class] = buf->next;
+    buf->next = NULL;
+
+    pool->stats.leased_bytes += buf->length;
+
+    return buf;
+}
+
+static void RDMAPoolPut(RDMABuffer* buf)
+{
+    RDMABufferPool* pool = buf->pool;
+
+    pool->stats.leased_bytes -= buf->length;
+
+    buf->next = pool->free_list[buf->size_class];
+    pool->free_list[buf->size_class] = buf;
+}
+
+struct RDMAContext;
+
+//
+// Work completion as handed from a CQ worker to the loop; the fields of
+// ibv_wc which OnCompletion() and JS look at, in less space.
+//
+typedef struct
+{
+    uint64_t                    wr_id;
+    uint32_t                    qp_num;
+    uint32_t                    epoch;          ///< ctx->epoch when reaped, see OnCompletion()
+    uint32_t                    byte_len;
+    uint32_t                    imm_data;       ///< Network order, as in ibv_wc
+    uint8_t                     status;         ///< enum ibv_wc_status
+    uint8_t                     opcode;         ///< enum ibv_wc_opcode
+} RDMAWCRecord;
+
+static const uint32_t RDMA_WC_RING_SIZE = 4096;    // Power of two
+
+//
+// Lock-free single-producer/single-consumer ring of RDMAWCRecord. The CQ
+// worker only advances `tail`, the loop only advances `head`; both are
+// free-running and masked on access. The indices sit on their own cache
+// lines so producer and consumer do not false-share.
+//
+typedef struct
+{
+    volatile uint32_t           head;           ///< Next record to consume
+    char                        pad0[64 - sizeof(uint32_t)];
+    volatile uint32_t           tail;           ///< Next slot to fill
+    char                        pad1[64 - sizeof(uint32_t)];
+
+    RDMAWCRecord                records[RDMA_WC_RING_SIZE];
+} RDMAWCRing;
+
+//
+// Publishes up to `n` records and returns how many fit.
+//
+static uint32_t RDMAWCRingPush(RDMAWCRing* ring, const RDMAWCRecord* recs, uint32_t n)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = ring->head;
+    __sync_synchronize();   // Slots are read by the loop before it moves head
+
+    uint32_t room = RDMA_WC_RING_SIZE - (tail - head);
+    if (n > room) {
+        n = room;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        ring->records[(tail + i) & (RDMA_WC_RING_SIZE - 1)] = recs[i];
+    }
+
+    __sync_synchronize();   // Records before the tail that publishes them
+    ring->tail = tail + n;
+
+    return n;
+}
+
+//
+// Takes up to `max` records and returns how many there were.
+//
+static uint32_t RDMAWCRingPop(RDMAWCRing* ring, RDMAWCRecord* recs, uint32_t max)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    __sync_synchronize();   // The tail before the records it publishes
+
+    uint32_t n = tail - head;
+    if (n > max) {
+        n = max;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        recs[i] = ring->records[(head + i) & (RDMA_WC_RING_SIZE - 1)];
+    }
+
+    __sync_synchronize();   // Done reading before the slots are handed back
+    ring->head = head + n;
+
+    return n;
+}
+
+//
+// Poller thread of one CQ, see RDMACQConfig. It busy-polls within the same
+// adaptive budget as the loop does, then sleeps on the completion channel.
+// Work completions reach the loop through `ring`, see RDMAWakeLoop().
+//
+typedef struct
+{
+    pthread_t                   thread;
+    int                         cpu;            ///< -1 if not pinned
+    volatile bool               stop;
+    int                         wake_pipe[2];   ///< Interrupts the sleep on stop
+    pthread_mutex_t             lock;           ///< Held while the worker uses the CQ
+
+    RDMAWCRing*                 ring;           ///< Reaped, not yet handled
+} RDMACQWorker;
+
+//
+// One completion queue of a context with its own completion channel.
+// Polled either from the loop (poll_handle/spin_handle) or by a worker.
+//
 typedef struct
+{
+    struct RDMAContext*         ctx;
+    int                         index;
+    struct ibv_cq*              cq;
+    struct ibv_comp_channel*    comp_channel;
+    int                         comp_vector;
+    int                         cq_size;        ///< Entries the CQ holds
+    int                         cq_reserved;    ///< Entries the QPs on it may need
+    int                         connections;    ///< Load, see RDMASelectCQ()
+
+    uv_poll_t                   poll_handle;    ///< Watches comp_channel->fd
+
+    uv_idle_t                   spin_handle;    ///< Busy-polls the CQ while active
+    bool                        spinning;
+    uint64_t                    spin_budget_ns; ///< Current (adaptive) budget
+    uint64_t                    avg_interval_ns;///< EWMA of completion interarrival
+    uint64_t                    last_completion_ns;
+
+    struct ibv_wc               wcs[RDMA_MAX_WC_BATCH];
+    unsigned int                unacked_events; ///< CQ events not yet acked
+
+    RDMACQWorker*               worker;         ///< NULL if polled from the loop
+} RDMACQ;
+
+//
+// Per-device context. Every connection on an ibv_context shares one, so
+// they share the PD (and with it the buffer pool's MRs) and the CQs. See
+// RDMAAcquireContext().
+//
+typedef struct RDMAContext
 {
     struct ibv_context*         ctx;            ///< Context
+    unsigned int                refs;           ///< Connections, leased Buffers and CM contexts using it
+    volatile uint32_t           epoch;          ///< Bumped whenever a QP is destroyed
     struct ibv_pd*              pd;             ///< Protection Domain
-    struct ibv_cq*              cq;             ///< Completion Queue
-    struct ibv_comp_channel*    comp_channel;   ///< Completion Event Channel
+    bool                        atomics;        ///< Device supports atomic operations
+    bool                        mw_type1;       ///< Device supports type 1 memory windows
+    bool                        mw_type2;       ///< Device supports type 2 memory windows
+    uint32_t                    max_qp_wr;      ///< Device limit on either work queue
+    RDMABufferPool*             pool;           ///< Registered buffers on pd
+
+    RDMACQ*                     cqs;            ///< Completion Queues
+    int                         num_cqs;
+
+    //
+    // Optional shared receive queue. When present every QP created on this
+    // context receives from it instead of owning a receive ring. Every
+    // connection is granted RDMA_RECV_DEPTH credits, so the SRQ is kept at
+    // least that deep per connection; a consumed receive is replaced before
+    // its credit goes back. The limit event refills it as a safety net.
+    //
+    struct ibv_srq*             srq;
+    uint32_t                    srq_base;       ///< Configured depth without connections
+    uint32_t                    srq_depth;      ///< Receives kept posted after a refill
+    uint32_t                    srq_max_wr;     ///< Capacity of the SRQ
+    uint32_t                    srq_limit;      ///< Low watermark armed on the SRQ
+    uint32_t                    srq_posted;     ///< Receives currently posted
+    uint32_t                    srq_connections;
+    uv_poll_t                   async_handle;   ///< Watches ctx->async_fd
+
+    std::map<uint32_t, struct RDMAConnection*>* qp_table;  ///< qp_num -> connection
+
+    int                         closing;        ///< uv handles still being closed
 } RDMAContext;
 
+// Live contexts by device, see RDMAAcquireContext().
+static std::map<struct ibv_context*, RDMAContext*> g_contexts;
+
+
+struct RDMAConnection;
+
+//
+// Called with every payload received on the connection, whether consumed in
+// place from the write ring or read by rendezvous. The data is only valid
+// for the duration of the call.
+//
+typedef void (*RDMARecvHandler)(struct RDMAConnection* conn, const char* data, uint32_t len);
+
+//
+// Called when a payload passed to RDMASendRegion() may be reused.
+//
+typedef void (*RDMASendDoneHandler)(struct RDMAConnection* conn, uint64_t cookie, int status);
+
+//
+// Picks the registered destination of a rendezvous payload. Returns false
+// to let the connection lease one from the pool instead.
+//
+typedef bool (*RDMARndvTargetHandler)(struct RDMAConnection* conn, uint32_t len,
+                                      char** addr, uint32_t* lkey);
+
+//
+// Connection events without arguments: drain, end and close.
+//
+typedef void (*RDMAConnEventHandler)(struct RDMAConnection* conn);
+
+//
+// Called when an RDMAOp completed, with an enum ibv_wc_status. The handler
+// owns the op from then on.
+//
+typedef void (*RDMAOpDoneHandler)(struct RDMAConnection* conn, struct RDMAOp* op, int status);
+
+//
+// A rendezvous payload being read from the peer.
+//
+typedef struct
+{
+    char*                       addr;           ///< Destination, once posted
+    uint32_t                    length;
+    uint64_t                    cookie;         ///< Peer's handle
+    RDMABuffer*                 buf;            ///< Pool lease, NULL for a target buffer
+    uint64_t                    remote_addr;    ///< From MSG_RNDV_RTS
+    uint32_t                    rkey;
+} RDMARndvRead;
+
+//
+// Memory window on the PD of a connection's context. It grants the peer
+// access to part of the exposed memory and is bound and revoked with work
+// requests on the connection's QP, see RDMAStartMWOp().
+//
+typedef struct RDMAMW
+{
+    struct ibv_mw*              mw;
+    uint32_t                    rkey;           ///< Of the current binding
+    bool                        bound;
+    int                         pending;        ///< Binds/invalidations not finished
+} RDMAMW;
+
+//
+// A one-sided operation on memory the peer exposed (MSG_EXPOSE). The local
+// side of the transfer is a pool buffer; atomics fetch the previous 64-bit
+// value into it.
+//
+// Binds (IBV_WR_BIND_MW) and invalidations (IBV_WR_LOCAL_INV) of a memory
+// window go through the same queue. They have no buffer; a bind grants
+// `bind_access` to `length` bytes at `bind_addr` of our exposed memory.
+//
+typedef struct RDMAOp
+{
+    enum ibv_wr_opcode          opcode;
+    RDMABuffer*                 buf;            ///< NULL for window operations
+    uint32_t                    length;
+    uint64_t                    remote_addr;
+    uint32_t                    rkey;
+    uint64_t                    compare_add;    ///< Atomics only
+    uint64_t                    swap;           ///< IBV_WR_ATOMIC_CMP_AND_SWP only
+    RDMAMW*                     mw;             ///< Window operations only
+    uint64_t                    bind_addr;      ///< IBV_WR_BIND_MW only
+    int                         bind_access;    ///< IBV_WR_BIND_MW only
+    void*                       data;           ///< For the op handler
+} RDMAOp;
 
+//
+// A signaled send completion retires `sends` sends, the signaled one last.
+// `op` is set when that one is an RDMAOp.
+//
 typedef struct
+{
+    uint32_t                    sends;
+    RDMAOp*                     op;
+} RDMASignaledBatch;
+
+typedef struct RDMAConnection
 {
     bool                        connected;
 
+    RDMAContext*                ctx;
+    RDMA*                       owner;          ///< Receives completions, may be NULL
+    int                         table_index;    ///< Slot in the server's table, -1 if none
+    RDMACQ*                     cq;             ///< Send and receive CQ of the QP
+    int                         cq_entries;     ///< Reserved on cq
+    uint32_t                    epoch;          ///< ctx->epoch when created
+
     struct rdma_cm_id*          id;
     struct ibv_qp*              qp;
 
-    struct ibv_mr*              recv_mr;
     struct ibv_mr*              send_mr;
     struct ibv_mr*              rdma_local_mr;
     struct ibv_mr*              rdma_remote_mr;
 
     struct ibv_mr               peer_mr;
 
-    RDMAMessage*                recv_msg;
-    RDMAMessage*                send_msg;
+    RDMAMessage*                recv_msg;       ///< Message being handled
+    RDMAMessage*                send_ring;      ///< RDMA_RECV_DEPTH slots, see RDMASendMessage()
+    uint32_t                    send_slot;      ///< Messages sent
 
     char*                       rdma_local_region;
     char*                       rdma_remote_region;
 
+    RDMABuffer*                 send_buf;       ///< Leased from the context pool
+    RDMABuffer*                 recv_ring[RDMA_RECV_DEPTH];
+    RDMABuffer*                 rdma_local_buf;
+    RDMABuffer*                 rdma_remote_buf;
+
+    uint32_t                    send_credits;       ///< Peer receives we may consume
+    uint32_t                    credits_to_return;  ///< Reposted, not yet advertised
+    std::deque<RDMAMessage>*    backlog;            ///< Waiting for credits
+
+    //
+    // RDMA-write ring. The peer writes records into rdma_remote_buf and rings
+    // the doorbell with the record length as immediate data; we write ours
+    // from the same offset of rdma_local_buf into the peer's ring.
+    //
+    uint64_t                    ring_tail;          ///< Bytes written to the peer ring
+    uint64_t                    ring_peer_head;     ///< Bytes the peer reported consumed
+    uint64_t                    ring_head;          ///< Bytes consumed from our ring
+    uint32_t                    ring_to_return;     ///< Consumed, not yet reported
+    std::deque<std::vector<char> >* ring_backlog;   ///< Waiting for space or credits
+
+    std::deque<RDMARndvRead>*   rndv_reads;         ///< Posted, in completion order
+    std::deque<RDMARndvRead>*   rndv_backlog;       ///< Waiting for send queue slots
+
+    //
+    // One-sided access. Each side may expose one pool buffer to the peer;
+    // RDMAOps target the region the peer exposed.
+    //
+    RDMABuffer*                 expose_buf;         ///< Ours, NULL if none
+    uint64_t                    peer_expose_addr;
+    uint32_t                    peer_expose_rkey;
+    uint32_t                    peer_expose_length; ///< 0 until MSG_EXPOSE arrived
+    std::deque<RDMAOp*>*        op_backlog;         ///< Waiting for send queue slots
+
+    RDMARecvHandler             recv_handler;
+    RDMASendDoneHandler         send_done_handler;
+    RDMARndvTargetHandler       rndv_target_handler;
+    RDMAConnEventHandler        drain_handler;      ///< Backlog emptied after a blocked send
+    RDMAConnEventHandler        end_handler;        ///< Peer sent MSG_DONE
+    RDMAConnEventHandler        close_handler;      ///< Connection is being destroyed
+    RDMAConnEventHandler        expose_handler;     ///< Peer sent MSG_EXPOSE
+    RDMAOpDoneHandler           op_done_handler;
+    void*                       data;               ///< For whoever installed the handlers
+
+    bool                        rx_paused;          ///< Withhold credits from the peer
+    bool                        tx_blocked;         ///< A send was backlogged, drain pending
+
     typedef enum {
         SS_INIT,
         SS_MR_SENT,
@@ -113,17 +745,38 @@ typedef struct
 
     recv_state_t                recv_state;
 
+    //
+    // Selective signaling. Only every signal_interval-th send (or one that
+    // nearly fills the send queue) is signaled; its completion retires the
+    // unsignaled sends posted before it. Each entry of signaled_batches is
+    // the number of sends a signaled completion retires.
+    //
+    uint32_t                    max_send_wr;    ///< As granted by the provider
+    uint32_t                    max_inline_data;
+    uint32_t                    sends_outstanding;
+    uint32_t                    sends_since_signal;
+    std::deque<RDMASignaledBatch>* signaled_batches;
+
 } RDMAConnection;
 
 //static void RDMAConnection::send_state
 
+static void RDMAStartPolling(RDMACQ* cq);
+static void RDMAFinishOp(RDMAConnection* conn, RDMAOp* op, int status);
+static void RDMAStartMWOp(RDMAConnection* conn, RDMAOp* op);
+static void RDMAStartRndvRead(RDMAConnection* conn, RDMARndvRead* rd);
+static void RDMAStartWorker(RDMACQ* cq);
+static void RDMAStopWorker(RDMACQ* cq);
+
 //
 // Builds internal RDMA context from ibv_context
 //
-static void BuildRDMAContext(struct ibv_context* verbs)
+static RDMAContext* BuildRDMAContext(struct ibv_context* verbs)
 {
     RDMAContext* ctx = (RDMAContext*)malloc(sizeof(RDMAContext));
     ctx->ctx    = verbs;
+    ctx->refs   = 0;
+    ctx->epoch  = 0;
 
     ctx->pd     = ibv_alloc_pd(ctx->ctx);
     if (!ctx->pd) {
@@ -131,111 +784,649 @@ static void BuildRDMAContext(struct ibv_context* verbs)
         exit(-1);
     }
 
-    ctx->comp_channel = ibv_create_comp_channel(ctx->ctx);
-    if (!ctx->comp_channel) {
-        fprintf(stderr, "Failed to operate ibv_create_comp_channel()\n");
-        exit(-1);
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(verbs, &dev_attr)) {
+        memset(&dev_attr, 0, sizeof(dev_attr));
     }
 
-    int cqe = 10;   // # of completion queue elements. This could be arbitrary
-    int comp_vector = 0;
-    ctx->cq = ibv_create_cq(ctx->ctx, cqe, NULL, ctx->comp_channel, comp_vector);
-    if (!ctx->cq) {
-        fprintf(stderr, "Failed to operate ibv_create_qp()\n");
-        exit(-1);
-    }
+    ctx->atomics  = dev_attr.atomic_cap != IBV_ATOMIC_NONE;
+    ctx->mw_type1 = (dev_attr.device_cap_flags & IBV_DEVICE_MEM_WINDOW) != 0;
+    ctx->mw_type2 = (dev_attr.device_cap_flags &
+                     (IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B)) != 0;
 
-    if (ibv_req_notify_cq(ctx->cq, 0)) {
-        fprintf(stderr, "Failed to operate ibv_req_notify_cq()\n");
-        exit(-1);
-    }
+    // Unknown if the query failed; the QP creation will tell then.
+    ctx->max_qp_wr = dev_attr.max_qp_wr > 0 ? dev_attr.max_qp_wr : (uint32_t)-1;
 
-    if (ibv_req_notify_cq(ctx->cq, 0)) {
-        fprintf(stderr, "Failed to operate ibv_req_notify_cq()\n");
-        exit(-1);
+    int access = RDMA_POOL_ACCESS;
+    if (ctx->mw_type1 || ctx->mw_type2) {
+        access |= IBV_ACCESS_MW_BIND;
     }
-}
+    ctx->pool = RDMAPoolCreate(ctx->pd, access);
 
-//
-// Buld queue pair attributes with RDMA context.
-//
-static void BuildQPAttr(const RDMAContext* ctx, struct ibv_qp_init_attr* qp_attr)
-{
-    memset(qp_attr, 0, sizeof(*qp_attr));
+    int num_vectors = verbs->num_comp_vectors > 0 ? verbs->num_comp_vectors : 1;
 
-    qp_attr->send_cq = ctx->cq;
-    qp_attr->recv_cq = ctx->cq;
-    qp_attr->qp_type = IBV_QPT_RC;
+    ctx->num_cqs = g_cq_config.num_cqs;
+    ctx->cqs     = (RDMACQ*)calloc(ctx->num_cqs, sizeof(RDMACQ));
 
-    qp_attr->cap.max_send_wr = 10;
-    qp_attr->cap.max_recv_wr = 10;
-    qp_attr->cap.max_send_sge = 1;
-    qp_attr->cap.max_recv_sge = 1;
-    
-}
+    for (int i = 0; i < ctx->num_cqs; i++) {
+        RDMACQ* cq = &ctx->cqs[i];
 
-static void RDMARegisterMemory(const RDMAContext* ctx, RDMAConnection* conn)
-{
-    conn->send_msg = (RDMAMessage*)malloc(sizeof(RDMAMessage));
-    conn->recv_msg = (RDMAMessage*)malloc(sizeof(RDMAMessage));
+        cq->ctx         = ctx;
+        cq->index       = i;
+        cq->comp_vector = i % num_vectors;
+
+        cq->comp_channel = ibv_create_comp_channel(ctx->ctx);
+        if (!cq->comp_channel) {
+            fprintf(stderr, "Failed to operate ibv_create_comp_channel()\n");
+            exit(-1);
+        }
 
-    conn->rdma_local_region     = (char*)malloc(RDMA_BUFFER_SIZE);
-    conn->rdma_remote_region    = (char*)malloc(RDMA_BUFFER_SIZE);
+        // Grown by RDMAReserveCQ() as connections are added.
+        cq->cq = ibv_create_cq(ctx->ctx, RDMA_MIN_CQE, cq, cq->comp_channel, cq->comp_vector);
+        if (!cq->cq) {
+            fprintf(stderr, "Failed to operate ibv_create_cq()\n");
+            exit(-1);
+        }
+        cq->cq_size     = cq->cq->cqe;
+        cq->cq_reserved = 0;
+        cq->connections = 0;
 
-    conn->send_mr = ibv_reg_mr(ctx->pd, conn->send_msg, sizeof(RDMAMessage), IBV_ACCESS_LOCAL_WRITE);
-    assert(conn->send_mr);
+        if (ibv_req_notify_cq(cq->cq, 0)) {
+            fprintf(stderr, "Failed to operate ibv_req_notify_cq()\n");
+            exit(-1);
+        }
 
-    conn->recv_mr = ibv_reg_mr(ctx->pd, conn->recv_msg, sizeof(RDMAMessage), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
-    assert(conn->recv_mr);
+        if (g_cq_config.workers) {
+            RDMAStartWorker(cq);
+        } else {
+            RDMAStartPolling(cq);
+        }
+    }
 
-    conn->rdma_local_mr = ibv_reg_mr(ctx->pd, conn->rdma_local_region, RDMA_BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE);
-    assert(conn->rdma_local_mr);
+    ctx->srq        = NULL;
+    ctx->qp_table   = new std::map<uint32_t, RDMAConnection*>();
+    ctx->closing    = 0;
 
-    conn->rdma_remote_mr = ibv_reg_mr(ctx->pd, conn->rdma_remote_region, RDMA_BUFFER_SIZE, IBV_ACCESS_REMOTE_WRITE);
-    assert(conn->rdma_remote_mr);
+    return ctx;
 }
 
-static void RDMAPostReceives(RDMAConnection* conn)
+static void RDMAFreeContext(RDMAContext* ctx)
 {
-    struct ibv_recv_wr wr;
-    struct ibv_recv_wr *bad_wr = NULL;
-    struct ibv_sge sge;
-
-    wr.wr_id = (uintptr_t)conn;
-    wr.next = NULL;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
+    for (int i = 0; i < ctx->num_cqs; i++) {
+        delete ctx->cqs[i].worker;
+    }
+    free(ctx->cqs);
+    free(ctx);
+}
 
-    sge.addr = (uintptr_t)conn->recv_msg;
-    sge.length = sizeof(RDMAMessage);
-    sge.lkey = conn->recv_mr->lkey;
+static void OnContextHandleClosed(uv_handle_t* handle)
+{
+    RDMAContext* ctx = (RDMAContext*)handle->data;
 
-    int ret = ibv_post_recv(conn->qp, &wr, &bad_wr);
-    assert(!ret);
+    if (--ctx->closing == 0) {
+        RDMAFreeContext(ctx);
+    }
 }
 
-static void Connection(RDMAContext* ctx, struct rdma_cm_id* id)
+//
+// Tears down a context nobody uses any more. The struct itself goes once
+// the loop has closed its handles.
+//
+static void DestroyRDMAContext(RDMAContext* ctx)
 {
-    RDMAConnection* conn;
-    struct ibv_qp_init_attr qp_attr;
+    // uv handle data points at the CQ, so closing callbacks find the
+    // context through it.
+    ctx->closing = ctx->srq ? 1 : 0;
+
+    for (int i = 0; i < ctx->num_cqs; i++) {
+        RDMACQ* cq = &ctx->cqs[i];
+
+        if (cq->worker) {
+            RDMAStopWorker(cq);
+        } else {
+            uv_poll_stop(&cq->poll_handle);
+            uv_idle_stop(&cq->spin_handle);
+            ctx->closing += 2;
+        }
 
-    BuildRDMAContext(id->verbs);
-    BuildQPAttr(ctx, &qp_attr);
+        // Destroying a CQ waits for every event to be acked.
+        if (cq->unacked_events) {
+            ibv_ack_cq_events(cq->cq, cq->unacked_events);
+            cq->unacked_events = 0;
+        }
+    }
 
-    int ret = rdma_create_qp(id, ctx->pd, &qp_attr);
-    assert(!ret);
+    if (ctx->srq) {
+        uv_poll_stop(&ctx->async_handle);
+        ibv_destroy_srq(ctx->srq);
+    }
 
-    conn->id = id;
-    conn->qp - id->qp;
-    
-    conn->send_state = RDMAConnection::SS_INIT;
-    conn->recv_state = RDMAConnection::RS_INIT;
+    for (int i = 0; i < ctx->num_cqs; i++) {
+        ibv_destroy_cq(ctx->cqs[i].cq);
+        ibv_destroy_comp_channel(ctx->cqs[i].comp_channel);
+    }
 
-    conn->connected  = 0;
+    // MRs go before the PD they were registered on.
+    RDMAPoolDestroy(ctx->pool);
+    ibv_dealloc_pd(ctx->pd);
+
+    delete ctx->qp_table;
+
+    for (int i = 0; i < ctx->num_cqs; i++) {
+        RDMACQ* cq = &ctx->cqs[i];
+
+        if (!cq->worker) {
+            cq->poll_handle.data = ctx;
+            cq->spin_handle.data = ctx;
+            uv_close((uv_handle_t*)&cq->poll_handle, OnContextHandleClosed);
+            uv_close((uv_handle_t*)&cq->spin_handle, OnContextHandleClosed);
+        }
+    }
+    if (ctx->srq) {
+        uv_close((uv_handle_t*)&ctx->async_handle, OnContextHandleClosed);
+    }
+
+    // Only CQ workers, nothing for the loop to close.
+    if (ctx->closing == 0) {
+        RDMAFreeContext(ctx);
+    }
+}
+
+//
+// Returns the shared context of a device, building it on first use. Each
+// call takes a reference, dropped with RDMAReleaseContext().
+//
+static RDMAContext* RDMAAcquireContext(struct ibv_context* verbs)
+{
+    std::map<struct ibv_context*, RDMAContext*>::iterator it = g_contexts.find(verbs);
+
+    RDMAContext* ctx;
+    if (it != g_contexts.end()) {
+        ctx = it->second;
+    } else {
+        ctx = BuildRDMAContext(verbs);
+        g_contexts[verbs] = ctx;
+    }
+
+    ctx->refs++;
+
+    return ctx;
+}
+
+static void RDMAReleaseContext(RDMAContext* ctx)
+{
+    assert(ctx->refs > 0);
+
+    if (--ctx->refs > 0) {
+        return;
+    }
+
+    g_contexts.erase(ctx->ctx);
+    DestroyRDMAContext(ctx);
+}
+
+//
+// The listener and the client keep a reference on every context they
+// connected through, so connection churn does not rebuild the PD, CQs and
+// buffer pool each time the last connection on a device goes away.
+//
+static void RDMAHoldContext(std::vector<RDMAContext*>* held, RDMAContext* ctx)
+{
+    if (std::find(held->begin(), held->end(), ctx) != held->end()) {
+        return;
+    }
+
+    ctx->refs++;
+    held->push_back(ctx);
+}
+
+static void RDMAReleaseHeldContexts(std::vector<RDMAContext*>* held)
+{
+    for (size_t i = 0; i < held->size(); i++) {
+        RDMAReleaseContext((*held)[i]);
+    }
+    held->clear();
+}
+
+//
+// Picks the CQ a new connection on `id` is bound to, see RDMACQConfig.
+//
+static RDMACQ* RDMASelectCQ(RDMAContext* ctx, struct rdma_cm_id* id)
+{
+    if (ctx->num_cqs == 1) {
+        return &ctx->cqs[0];
+    }
+
+    if (g_cq_config.assign == RDMACQConfig::ASSIGN_HASH) {
+        // FNV-1a over the peer's address and port, so a peer keeps landing
+        // on the same CQ (and core) across reconnects.
+        struct sockaddr* addr = rdma_get_peer_addr(id);
+        const unsigned char* p = (const unsigned char*)addr;
+        size_t len = (addr->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6)
+                                                   : sizeof(struct sockaddr_in);
+
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ p[i]) * 16777619u;
+        }
+
+        return &ctx->cqs[h % ctx->num_cqs];
+    }
+
+    RDMACQ* best = &ctx->cqs[0];
+    for (int i = 1; i < ctx->num_cqs; i++) {
+        if (ctx->cqs[i].connections < best->connections) {
+            best = &ctx->cqs[i];
+        }
+    }
+
+    return best;
+}
+
+//
+// Makes room on a CQ for `entries` more work completions, or gives back
+// room with a negative count. A CQ overrun would be fatal to every
+// connection on it, so the CQ is grown ahead of need.
+//
+static void RDMAReserveCQ(RDMACQ* cq, int entries)
+{
+    cq->cq_reserved += entries;
+
+    if (cq->cq_reserved <= cq->cq_size) {
+        return;
+    }
+
+    int size = cq->cq_size;
+    while (size < cq->cq_reserved) {
+        size *= 2;
+    }
+
+    // A worker must not poll the CQ while it is being resized.
+    if (cq->worker) {
+        pthread_mutex_lock(&cq->worker->lock);
+    }
+
+    int ret = ibv_resize_cq(cq->cq, size);
+
+    if (cq->worker) {
+        pthread_mutex_unlock(&cq->worker->lock);
+    }
+
+    if (ret) {
+        fprintf(stderr, "Failed to operate ibv_resize_cq()\n");
+        exit(-1);
+    }
+
+    cq->cq_size = cq->cq->cqe;
+}
+
+//
+// Buld queue pair attributes with RDMA context.
+//
+static void BuildQPAttr(const RDMAContext* ctx, const RDMACQ* cq, struct ibv_qp_init_attr* qp_attr)
+{
+    memset(qp_attr, 0, sizeof(*qp_attr));
+
+    qp_attr->send_cq = cq->cq;
+    qp_attr->recv_cq = cq->cq;
+    qp_attr->qp_type = IBV_QPT_RC;
+    qp_attr->sq_sig_all = 0;    // Sends request completions selectively
+
+    // Every work request we post has a single SG entry.
+    qp_attr->cap.max_send_wr = std::min(g_qp_config.max_send_wr, ctx->max_qp_wr);
+    qp_attr->cap.max_recv_wr = std::min(g_qp_config.max_recv_wr, ctx->max_qp_wr);
+    qp_attr->cap.max_send_sge = 1;
+    qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = g_qp_config.max_inline_data;
+
+    if (ctx->srq) {
+        qp_attr->srq = ctx->srq;
+    }
+}
+
+//
+// Leases the message and RDMA regions of the connection from the pool. No
+// memory registration happens here unless the pool has to grow.
+//
+static void RDMARegisterMemory(const RDMAContext* ctx, RDMAConnection* conn)
+{
+    conn->send_buf          = RDMAPoolGet(ctx->pool, RDMA_RECV_DEPTH * sizeof(RDMAMessage));
+    conn->rdma_local_buf    = RDMAPoolGet(ctx->pool, RDMA_RING_SIZE);
+    conn->rdma_remote_buf   = RDMAPoolGet(ctx->pool, RDMA_RING_SIZE);
+
+    // With a shared receive queue the context owns the receive buffers.
+    if (!ctx->srq) {
+        for (uint32_t i = 0; i < RDMA_RECV_DEPTH; i++) {
+            conn->recv_ring[i] = RDMAPoolGet(ctx->pool, sizeof(RDMAMessage));
+        }
+    }
+
+    conn->send_ring = (RDMAMessage*)conn->send_buf->addr;
+    conn->send_slot = 0;
+    conn->recv_msg = NULL;
+
+    conn->rdma_local_region     = (char*)conn->rdma_local_buf->addr;
+    conn->rdma_remote_region    = (char*)conn->rdma_remote_buf->addr;
+
+    conn->send_mr           = conn->send_buf->mr;
+    conn->rdma_local_mr     = conn->rdma_local_buf->mr;
+    conn->rdma_remote_mr    = conn->rdma_remote_buf->mr;
+}
+
+//
+// Posts one receive on the SRQ, e.g. to replace one just consumed.
+//
+static void RDMAPostSRQReceive(RDMAContext* ctx, RDMABuffer* buf)
+{
+    struct ibv_recv_wr wr;
+    struct ibv_recv_wr *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    wr.wr_id = (uintptr_t)buf;
+    wr.next = NULL;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    sge.addr = (uintptr_t)buf->addr;
+    sge.length = sizeof(RDMAMessage);
+    sge.lkey = buf->mr->lkey;
+
+    int ret = ibv_post_srq_recv(ctx->srq, &wr, &bad_wr);
+    assert(!ret);
+
+    ctx->srq_posted++;
+}
+
+//
+// Tops the SRQ back up to srq_depth with message buffers from the pool in a
+// single chained post, then re-arms the low watermark.
+//
+static void RDMARefillSRQ(RDMAContext* ctx)
+{
+    uint32_t n = ctx->srq_posted < ctx->srq_depth ? ctx->srq_depth - ctx->srq_posted : 0;
+
+    if (n > 0) {
+        std::vector<struct ibv_recv_wr> wrs(n);
+        std::vector<struct ibv_sge> sges(n);
+
+        for (uint32_t i = 0; i < n; i++) {
+            RDMABuffer* buf = RDMAPoolGet(ctx->pool, sizeof(RDMAMessage));
+
+            sges[i].addr    = (uintptr_t)buf->addr;
+            sges[i].length  = sizeof(RDMAMessage);
+            sges[i].lkey    = buf->mr->lkey;
+
+            wrs[i].wr_id    = (uintptr_t)buf;
+            wrs[i].sg_list  = &sges[i];
+            wrs[i].num_sge  = 1;
+            wrs[i].next     = (i + 1 < n) ? &wrs[i + 1] : NULL;
+        }
+
+        struct ibv_recv_wr* bad_wr = NULL;
+        int ret = ibv_post_srq_recv(ctx->srq, &wrs[0], &bad_wr);
+        assert(!ret);
+
+        ctx->srq_posted += n;
+    }
+
+    struct ibv_srq_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.srq_limit = ctx->srq_limit;
+
+    int ret = ibv_modify_srq(ctx->srq, &attr, IBV_SRQ_LIMIT);
+    assert(!ret);
+}
+
+//
+// Handles asynchronous device events; the SRQ limit event triggers a refill.
+//
+static void OnAsyncEvent(uv_poll_t* handle, int status, int events)
+{
+    RDMAContext*            ctx = (RDMAContext*)handle->data;
+    struct ibv_async_event  event;
+
+    if (status < 0) {
+        fprintf(stderr, "Failed to poll async event fd\n");
+        return;
+    }
+
+    while (ibv_get_async_event(ctx->ctx, &event) == 0) {
+        enum ibv_event_type type = event.event_type;
+        ibv_ack_async_event(&event);
+
+        if (type == IBV_EVENT_SRQ_LIMIT_REACHED && ctx->srq) {
+            RDMARefillSRQ(ctx);
+        }
+    }
+
+    assert(errno == EAGAIN);
+}
+
+//
+// Creates the shared receive queue of the context. QPs created afterwards
+// receive from it.
+//
+static void RDMAEnableSRQ(RDMAContext* ctx, uint32_t depth, uint32_t limit)
+{
+    struct ibv_srq_init_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.attr.max_wr  = depth;
+    attr.attr.max_sge = 1;
+
+    ctx->srq = ibv_create_srq(ctx->pd, &attr);
+    if (!ctx->srq) {
+        fprintf(stderr, "Failed to operate ibv_create_srq()\n");
+        exit(-1);
+    }
+
+    ctx->srq_base        = depth;
+    ctx->srq_depth       = depth;
+    ctx->srq_max_wr      = attr.attr.max_wr;    // May be rounded up
+    ctx->srq_limit       = limit;
+    ctx->srq_posted      = 0;
+    ctx->srq_connections = 0;
+
+    // SRQ receives complete on the CQ of whichever QP consumed them.
+    for (int i = 0; i < ctx->num_cqs; i++) {
+        RDMAReserveCQ(&ctx->cqs[i], depth);
+    }
+
+    int fd = ctx->ctx->async_fd;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Failed to set async event fd non-blocking\n");
+        exit(-1);
+    }
+
+    int ret = uv_poll_init(uv_default_loop(), &ctx->async_handle, fd);
+    assert(ret == 0);
+    ctx->async_handle.data = ctx;
+
+    ret = uv_poll_start(&ctx->async_handle, UV_READABLE, OnAsyncEvent);
+    assert(ret == 0);
+
+    RDMARefillSRQ(ctx);
+}
+
+//
+// Accounts for the credits granted to a connection receiving from the SRQ
+// (`delta` is +1 or -1 connection). The SRQ grows so that every credit in
+// flight is backed by a posted receive; the peer never gets an RNR NAK.
+//
+static void RDMAUpdateSRQDepth(RDMAContext* ctx, int delta)
+{
+    ctx->srq_connections += delta;
+
+    uint32_t depth = std::max(ctx->srq_base, ctx->srq_connections * RDMA_RECV_DEPTH);
+
+    if (depth > ctx->srq_max_wr) {
+        struct ibv_srq_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.max_wr = std::max(depth, 2 * ctx->srq_max_wr);
+
+        if (ibv_modify_srq(ctx->srq, &attr, IBV_SRQ_MAX_WR)) {
+            fprintf(stderr, "Failed to operate ibv_modify_srq()\n");
+            exit(-1);
+        }
+
+        ctx->srq_max_wr = attr.max_wr;
+    }
+
+    // Receives beyond a smaller depth are simply not replaced once used.
+    ctx->srq_depth = depth;
+
+    if (delta > 0) {
+        for (int i = 0; i < ctx->num_cqs; i++) {
+            RDMAReserveCQ(&ctx->cqs[i], RDMA_RECV_DEPTH);
+        }
+        RDMARefillSRQ(ctx);
+    } else {
+        for (int i = 0; i < ctx->num_cqs; i++) {
+            RDMAReserveCQ(&ctx->cqs[i], -(int)RDMA_RECV_DEPTH);
+        }
+    }
+}
+
+//
+// Hands a consumed SRQ receive back: reposted while the SRQ is below its
+// depth, otherwise returned to the pool.
+//
+static void RDMARecycleSRQReceive(RDMAContext* ctx, RDMABuffer* buf)
+{
+    if (ctx->srq_posted < ctx->srq_depth) {
+        RDMAPostSRQReceive(ctx, buf);
+    } else {
+        RDMAPoolPut(buf);
+    }
+}
+
+//
+// Posts one message receive. wr_id carries the buffer; the connection is
+// found from the QP number on completion.
+//
+static void RDMAPostReceive(RDMAConnection* conn, RDMABuffer* buf)
+{
+    struct ibv_recv_wr wr;
+    struct ibv_recv_wr *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    wr.wr_id = (uintptr_t)buf;
+    wr.next = NULL;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    sge.addr = (uintptr_t)buf->addr;
+    sge.length = sizeof(RDMAMessage);
+    sge.lkey = buf->mr->lkey;
+
+    int ret = ibv_post_recv(conn->qp, &wr, &bad_wr);
+    assert(!ret);
+}
+
+static void RDMAPostReceives(RDMAConnection* conn)
+{
+    // With a shared receive queue the context keeps receives posted.
+    if (conn->ctx->srq) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < RDMA_RECV_DEPTH; i++) {
+        RDMAPostReceive(conn, conn->recv_ring[i]);
+    }
+}
+
+//
+// Creates the connection for a CM id on `ctx`, which must be the shared
+// context of id->verbs. The connection takes over the caller's reference to
+// the context.
+//
+static RDMAConnection* Connection(RDMAContext* ctx, struct rdma_cm_id* id)
+{
+    RDMAConnection* conn = (RDMAConnection*)calloc(1, sizeof(RDMAConnection));
+    struct ibv_qp_init_attr qp_attr;
+
+    assert(ctx->ctx == id->verbs);
+
+    conn->cq = RDMASelectCQ(ctx, id);
+    BuildQPAttr(ctx, conn->cq, &qp_attr);
+
+    // Devices do not report their inline limit, so back off until the
+    // provider accepts the request.
+    int ret;
+    while ((ret = rdma_create_qp(id, ctx->pd, &qp_attr)) && qp_attr.cap.max_inline_data > 0) {
+        qp_attr.cap.max_inline_data /= 2;
+    }
+    assert(!ret);
+
+    conn->id = id;
+    conn->qp = id->qp;
+    conn->ctx = ctx;
+    conn->owner = NULL;
+    conn->table_index = -1;
+
+    // CM events find their connection through the id.
+    id->context = conn;
+
+    (*ctx->qp_table)[conn->qp->qp_num] = conn;
+    conn->epoch = ctx->epoch;
+
+    conn->send_state = RDMAConnection::SS_INIT;
+    conn->recv_state = RDMAConnection::RS_INIT;
+
+    conn->connected  = 0;
+
+    conn->cq_entries         = qp_attr.cap.max_send_wr + (ctx->srq ? 0 : qp_attr.cap.max_recv_wr);
+    RDMAReserveCQ(conn->cq, conn->cq_entries);
+    conn->cq->connections++;
+
+    if (ctx->srq) {
+        RDMAUpdateSRQDepth(ctx, 1);
+    }
+
+    conn->max_send_wr        = qp_attr.cap.max_send_wr;
+    conn->max_inline_data    = qp_attr.cap.max_inline_data;
+    conn->sends_outstanding  = 0;
+    conn->sends_since_signal = 0;
+    conn->signaled_batches   = new std::deque<RDMASignaledBatch>();
+
+    // Both sides post RDMA_RECV_DEPTH receives up front (an SRQ server
+    // grants the same allowance per connection).
+    conn->send_credits       = RDMA_RECV_DEPTH;
+    conn->credits_to_return  = 0;
+    conn->backlog            = new std::deque<RDMAMessage>();
+
+    conn->ring_tail          = 0;
+    conn->ring_peer_head     = 0;
+    conn->ring_head          = 0;
+    conn->ring_to_return     = 0;
+    conn->ring_backlog       = new std::deque<std::vector<char> >();
+    conn->rndv_reads         = new std::deque<RDMARndvRead>();
+    conn->rndv_backlog       = new std::deque<RDMARndvRead>();
+
+    conn->expose_buf         = NULL;
+    conn->peer_expose_addr   = 0;
+    conn->peer_expose_rkey   = 0;
+    conn->peer_expose_length = 0;
+    conn->op_backlog         = new std::deque<RDMAOp*>();
+
+    conn->recv_handler        = NULL;
+    conn->send_done_handler   = NULL;
+    conn->rndv_target_handler = NULL;
+    conn->drain_handler       = NULL;
+    conn->end_handler         = NULL;
+    conn->close_handler       = NULL;
+    conn->expose_handler      = NULL;
+    conn->op_done_handler     = NULL;
+    conn->data                = NULL;
+
+    conn->rx_paused           = false;
+    conn->tx_blocked          = false;
 
     RDMARegisterMemory(ctx, conn);
     RDMAPostReceives(conn);
-    
+
+    return conn;
 }
 
 //
@@ -245,328 +1436,3385 @@ static void RDMADestroyConnection(void *context)
 {
     RDMAConnection* conn = (RDMAConnection*)context;
 
-    rdma_destroy_qp(conn->id);
+    conn->connected = 0;
+
+    // Operations which will not complete any more, posted ones first.
+    for (size_t i = 0; i < conn->signaled_batches->size(); i++) {
+        if ((*conn->signaled_batches)[i].op) {
+            RDMAFinishOp(conn, (*conn->signaled_batches)[i].op, IBV_WC_WR_FLUSH_ERR);
+        }
+    }
+    for (size_t i = 0; i < conn->op_backlog->size(); i++) {
+        RDMAFinishOp(conn, (*conn->op_backlog)[i], IBV_WC_WR_FLUSH_ERR);
+    }
+
+    if (conn->close_handler) {
+        conn->close_handler(conn);
+    }
+
+    conn->ctx->qp_table->erase(conn->qp->qp_num);
+
+    // The QP number may be reused by the next connection, while a worker
+    // may still hold completions of this one in its ring. Those were
+    // reaped before the epoch moves on, so OnCompletion() drops them.
+    RDMACQWorker* w = conn->cq->worker;
+    if (w) {
+        pthread_mutex_lock(&w->lock);
+    }
+
+    rdma_destroy_qp(conn->id);
+    conn->ctx->epoch++;
+
+    if (w) {
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    RDMAPoolPut(conn->send_buf);
+    RDMAPoolPut(conn->rdma_local_buf);
+    RDMAPoolPut(conn->rdma_remote_buf);
+
+    if (!conn->ctx->srq) {
+        for (uint32_t i = 0; i < RDMA_RECV_DEPTH; i++) {
+            RDMAPoolPut(conn->recv_ring[i]);
+        }
+    }
+
+    rdma_destroy_id(conn->id);
+
+    delete conn->backlog;
+    delete conn->ring_backlog;
+
+    for (size_t i = 0; i < conn->rndv_reads->size(); i++) {
+        if ((*conn->rndv_reads)[i].buf) {
+            RDMAPoolPut((*conn->rndv_reads)[i].buf);
+        }
+    }
+    delete conn->rndv_reads;
+    delete conn->rndv_backlog;
+    delete conn->signaled_batches;
+    delete conn->op_backlog;
+
+    RDMAReserveCQ(conn->cq, -conn->cq_entries);
+    conn->cq->connections--;
+
+    if (conn->ctx->srq) {
+        RDMAUpdateSRQDepth(conn->ctx, -1);
+    }
+
+    RDMAReleaseContext(conn->ctx);
+
+    free(conn);
+
+}
+
+//
+// Returns the send_flags for the next send on the connection and does the
+// bookkeeping needed to retire it later.
+//
+static int RDMANextSendFlags(RDMAConnection* conn)
+{
+    conn->sends_outstanding++;
+    conn->sends_since_signal++;
+
+    if (conn->sends_since_signal >= g_qp_config.signal_interval ||
+        conn->sends_outstanding + 1 >= conn->max_send_wr ||
+        conn->signaled_batches->empty()) {
+        RDMASignaledBatch batch = { conn->sends_since_signal, NULL };
+        conn->signaled_batches->push_back(batch);
+        conn->sends_since_signal = 0;
+        return IBV_SEND_SIGNALED;
+    }
+
+    return 0;
+}
+
+//
+// Like RDMANextSendFlags() for work requests which must always complete
+// with a work completion of their own. `op` is the RDMAOp posted, if any.
+//
+static int RDMASignaledSendFlags(RDMAConnection* conn, RDMAOp* op)
+{
+    RDMASignaledBatch batch = { conn->sends_since_signal + 1, op };
+
+    conn->sends_outstanding++;
+    conn->signaled_batches->push_back(batch);
+    conn->sends_since_signal = 0;
+
+    return IBV_SEND_SIGNALED;
+}
+
+//
+// Posts a signaled zero-length RDMA write behind unsignaled sends which
+// no signaled send follows. Its completion retires them. No data moves,
+// so neither the rkey nor a receive of the peer is involved.
+//
+static void RDMAPostFlush(RDMAConnection* conn)
+{
+    struct ibv_send_wr wr;
+    struct ibv_send_wr *bad_wr = NULL;
+
+    memset(&wr, 0, sizeof(wr));
+
+    wr.wr_id = RDMA_SEND_WR_ID;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.num_sge = 0;
+    wr.send_flags = RDMASignaledSendFlags(conn, NULL);
+
+    int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+    assert(!ret);
+}
+
+//
+// Posts a message, spending one credit. Credits owed to the peer ride along.
+//
+// Unless it goes inline, the HCA reads the message from registered memory
+// some time after the post, so every message gets its own slot of
+// send_ring. Slots are reused after RDMA_RECV_DEPTH messages: by then the
+// credits spent have come back, i.e. the peer has received the message
+// which last used the slot.
+//
+static void RDMASendMessage(RDMAConnection* conn, const RDMAMessage* msg)
+{
+    struct ibv_send_wr wr;
+    struct ibv_send_wr *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    RDMAMessage* send_msg = &conn->send_ring[conn->send_slot++ % RDMA_RECV_DEPTH];
+
+    memcpy(send_msg, msg, sizeof(RDMAMessage));
+    conn->send_credits--;
+
+    // A paused receiver keeps the credits, which stalls the peer's sends.
+    if (!conn->rx_paused) {
+        send_msg->credits       = conn->credits_to_return;
+        send_msg->ring_consumed = conn->ring_to_return;
+
+        conn->credits_to_return = 0;
+        conn->ring_to_return    = 0;
+    }
+
+    memset(&wr, 0, sizeof(wr));
+
+    wr.wr_id = RDMA_SEND_WR_ID;
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = RDMANextSendFlags(conn);
+
+    // Control messages are small enough to travel inside the WQE, which
+    // saves the HCA a DMA read of send_msg.
+    if (sizeof(RDMAMessage) <= conn->max_inline_data) {
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+
+    sge.addr = (uintptr_t)send_msg;
+    sge.length = sizeof(RDMAMessage);
+    sge.lkey = conn->send_mr->lkey;
+
+    int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+    assert(!ret);
+
+}
+
+//
+// Whether the send queue has room for another work request, keeping one
+// slot for RDMAPostFlush(). Before ESTABLISHED there is none: everything
+// waits in the backlogs until OnConnect() flushes them.
+//
+static bool RDMASendQueueHasRoom(const RDMAConnection* conn)
+{
+    return conn->connected && conn->sends_outstanding + 2 <= conn->max_send_wr;
+}
+
+static bool RDMAHasCredit(const RDMAConnection* conn)
+{
+    if (!RDMASendQueueHasRoom(conn)) {
+        return false;
+    }
+
+    if (conn->send_credits > 1) {
+        return true;
+    }
+
+    // The last credit only goes to a message that hands credits back.
+    return conn->send_credits == 1 && !conn->rx_paused && conn->credits_to_return > 0;
+}
+
+//
+// Bytes a record of `len` takes in a ring of `size` when written at `pos`.
+// Records never wrap: one that does not fit before the end of the ring
+// starts at offset 0 and the rest of the ring is skipped. Both sides apply
+// the same rule, so the doorbell only needs to carry the length.
+//
+static uint32_t RDMARingSpan(uint64_t pos, uint32_t size, uint32_t len)
+{
+    uint32_t off = pos % size;
+
+    return (off + len > size) ? (size - off) + len : len;
+}
+
+static bool RDMARingCanWrite(const RDMAConnection* conn, uint32_t len)
+{
+    // The peer's ring is unknown until its MR arrives.
+    if (conn->recv_state == RDMAConnection::RS_INIT) {
+        return false;
+    }
+
+    // The doorbell consumes a receive but returns no credits, so it may
+    // never take the reserved last credit.
+    if (conn->send_credits < 2 || !RDMASendQueueHasRoom(conn)) {
+        return false;
+    }
+
+    uint32_t size = conn->peer_mr.length;
+    uint32_t span = RDMARingSpan(conn->ring_tail, size, len);
+
+    return (conn->ring_tail - conn->ring_peer_head) + span <= size;
+}
+
+//
+// Writes one record into the peer's ring with RDMA_WRITE_WITH_IMM.
+//
+static void RDMARingWrite(RDMAConnection* conn, const char* data, uint32_t len)
+{
+    struct ibv_send_wr wr;
+    struct ibv_send_wr *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    uint32_t size = conn->peer_mr.length;
+    uint32_t span = RDMARingSpan(conn->ring_tail, size, len);
+    uint32_t off  = (conn->ring_tail + span - len) % size;
+
+    // Stage at the peer's offset: once the peer reports the record consumed
+    // the write has landed, so staging space frees up along with the ring.
+    memcpy(conn->rdma_local_region + off, data, len);
+
+    memset(&wr, 0, sizeof(wr));
+
+    wr.wr_id = RDMA_SEND_WR_ID;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = htonl(len);
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = RDMANextSendFlags(conn);
+    wr.wr.rdma.remote_addr = (uintptr_t)conn->peer_mr.addr + off;
+    wr.wr.rdma.rkey = conn->peer_mr.rkey;
+
+    if (len <= conn->max_inline_data) {
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+
+    sge.addr = (uintptr_t)(conn->rdma_local_region + off);
+    sge.length = len;
+    sge.lkey = conn->rdma_local_mr->lkey;
+
+    int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+    assert(!ret);
+
+    conn->ring_tail += span;
+    conn->send_credits--;
+}
+
+//
+// Posts a one-sided operation. It needs no credit, only a send queue slot.
+//
+static void RDMAStartOp(RDMAConnection* conn, RDMAOp* op)
+{
+    struct ibv_send_wr wr;
+    struct ibv_send_wr *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    if (op->mw) {
+        RDMAStartMWOp(conn, op);
+        return;
+    }
+
+    memset(&wr, 0, sizeof(wr));
+
+    wr.wr_id = RDMA_SEND_WR_ID;
+    wr.opcode = op->opcode;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = RDMASignaledSendFlags(conn, op);
+
+    if (op->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+        op->opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+        wr.wr.atomic.remote_addr = op->remote_addr;
+        wr.wr.atomic.compare_add = op->compare_add;
+        wr.wr.atomic.swap        = op->swap;
+        wr.wr.atomic.rkey        = op->rkey;
+    } else {
+        wr.wr.rdma.remote_addr = op->remote_addr;
+        wr.wr.rdma.rkey        = op->rkey;
+    }
+
+    sge.addr = (uintptr_t)op->buf->addr;
+    sge.length = op->length;
+    sge.lkey = op->buf->mr->lkey;
+
+    int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+    assert(!ret);
+}
+
+//
+// Posts an operation now if the send queue has room, otherwise queues it.
+//
+static void RDMAPostOp(RDMAConnection* conn, RDMAOp* op)
+{
+    if (conn->op_backlog->empty() && RDMASendQueueHasRoom(conn)) {
+        RDMAStartOp(conn, op);
+    } else {
+        conn->op_backlog->push_back(op);
+    }
+}
+
+//
+// Hands a finished operation to the handler, or drops it if there is none.
+//
+static void RDMAFinishOp(RDMAConnection* conn, RDMAOp* op, int status)
+{
+    if (op->mw) {
+        op->mw->pending--;
+    }
+
+    if (conn->op_done_handler) {
+        conn->op_done_handler(conn, op, status);
+        return;
+    }
+
+    if (op->buf) {
+        RDMAPoolPut(op->buf);
+    }
+    delete op;
+}
+
+//
+// Sends backlogged messages while credits last, then returns pending
+// credits and ring space explicitly if enough of them have piled up.
+//
+static void RDMAFlushBacklog(RDMAConnection* conn)
+{
+    // Reads first: the peer holds their payloads until MSG_RNDV_FIN.
+    while (!conn->rndv_backlog->empty() && RDMASendQueueHasRoom(conn)) {
+        RDMARndvRead rd = conn->rndv_backlog->front();
+        conn->rndv_backlog->pop_front();
+        RDMAStartRndvRead(conn, &rd);
+    }
+
+    while (!conn->op_backlog->empty() && RDMASendQueueHasRoom(conn)) {
+        RDMAOp* op = conn->op_backlog->front();
+        conn->op_backlog->pop_front();
+        RDMAStartOp(conn, op);
+    }
+
+    while (!conn->backlog->empty() && RDMAHasCredit(conn)) {
+        RDMAMessage msg = conn->backlog->front();
+        conn->backlog->pop_front();
+        RDMASendMessage(conn, &msg);
+    }
+
+    // Control messages go first, they may be what the peer is waiting on.
+    while (conn->backlog->empty() && !conn->ring_backlog->empty()) {
+        std::vector<char>& rec = conn->ring_backlog->front();
+        if (!RDMARingCanWrite(conn, rec.size())) {
+            break;
+        }
+        RDMARingWrite(conn, &rec[0], rec.size());
+        conn->ring_backlog->pop_front();
+    }
+
+    bool update = conn->credits_to_return >= RDMA_CREDIT_UPDATE_THRESHOLD ||
+                  conn->ring_to_return >= conn->rdma_remote_buf->length / 2;
+
+    if (update && !conn->rx_paused && conn->send_credits > 0 &&
+        RDMASendQueueHasRoom(conn)) {
+        RDMAMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = RDMAMessage::MSG_CREDIT;
+        RDMASendMessage(conn, &msg);
+    }
+}
+
+//
+// Tells the drain handler once every send that had to wait went out.
+//
+static void RDMANotifyDrain(RDMAConnection* conn)
+{
+    if (!conn->tx_blocked || !conn->backlog->empty() || !conn->ring_backlog->empty()) {
+        return;
+    }
+
+    conn->tx_blocked = false;
+
+    if (conn->drain_handler) {
+        conn->drain_handler(conn);
+    }
+}
+
+//
+// Sends a message now if a credit is available, otherwise queues it.
+//
+static void RDMAPostMessage(RDMAConnection* conn, const RDMAMessage* msg)
+{
+    if (conn->backlog->empty() && RDMAHasCredit(conn)) {
+        RDMASendMessage(conn, msg);
+    } else {
+        conn->backlog->push_back(*msg);
+    }
+}
+
+//
+// Tells the peer which memory its one-sided operations go to from now on.
+// A length of 0 withdraws it.
+//
+static void RDMASendExpose(RDMAConnection* conn, uint64_t addr, uint32_t rkey, uint32_t length)
+{
+    RDMAMessage msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = RDMAMessage::MSG_EXPOSE;
+    msg.data.expose.addr   = addr;
+    msg.data.expose.rkey   = rkey;
+    msg.data.expose.length = length;
+
+    RDMAPostMessage(conn, &msg);
+}
+
+//
+// Sets `buf` aside for one-sided operations of the peer and, if `grant`,
+// hands it the MR's rkey for all of it. Without the grant, access is only
+// given through memory windows. The caller keeps it leased until the
+// connection is destroyed.
+//
+static void RDMAExpose(RDMAConnection* conn, RDMABuffer* buf, uint32_t length, bool grant)
+{
+    assert(!conn->expose_buf);
+    conn->expose_buf = buf;
+
+    if (grant) {
+        RDMASendExpose(conn, (uintptr_t)buf->addr, buf->mr->rkey, length);
+    }
+}
+
+//
+// Binds or revokes a memory window over the exposed memory, then points
+// the peer at the result; the message is ordered after the work request
+// on the send queue. Type 1 windows are bound with ibv_bind_mw(), which
+// picks the rkey, and revoked by binding an empty range. Type 2 windows
+// take an IBV_WR_BIND_MW with the window's next rkey and are revoked with
+// IBV_WR_LOCAL_INV.
+//
+static void RDMAStartMWOp(RDMAConnection* conn, RDMAOp* op)
+{
+    RDMAMW* m = op->mw;
+    bool bind = op->opcode == IBV_WR_BIND_MW;
+    int ret;
+
+    struct ibv_mw_bind_info info;
+    memset(&info, 0, sizeof(info));
+    info.mr = conn->expose_buf->mr;
+    if (bind) {
+        info.addr            = op->bind_addr;
+        info.length          = op->length;
+        info.mw_access_flags = op->bind_access;
+    }
+
+    if (m->mw->type == IBV_MW_TYPE_1) {
+        struct ibv_mw_bind mw_bind;
+        memset(&mw_bind, 0, sizeof(mw_bind));
+        mw_bind.wr_id      = RDMA_SEND_WR_ID;
+        mw_bind.send_flags = RDMASignaledSendFlags(conn, op);
+        mw_bind.bind_info  = info;
+
+        ret = ibv_bind_mw(conn->qp, m->mw, &mw_bind);
+        m->rkey = m->mw->rkey;
+    } else {
+        struct ibv_send_wr wr;
+        struct ibv_send_wr *bad_wr = NULL;
+
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id      = RDMA_SEND_WR_ID;
+        wr.opcode     = op->opcode;
+        wr.send_flags = RDMASignaledSendFlags(conn, op);
+
+        if (bind) {
+            wr.bind_mw.mw        = m->mw;
+            wr.bind_mw.rkey      = ibv_inc_rkey(m->rkey);
+            wr.bind_mw.bind_info = info;
+        } else {
+            wr.invalidate_rkey   = m->rkey;
+        }
+
+        ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+        if (bind) {
+            m->rkey = wr.bind_mw.rkey;
+        }
+    }
+    assert(!ret);
+
+    op->rkey = m->rkey;
+
+    if (bind) {
+        RDMASendExpose(conn, op->bind_addr, m->rkey, op->length);
+    } else {
+        RDMASendExpose(conn, 0, 0, 0);
+    }
+}
+
+//
+// Sends `len` bytes as a record in the peer's write ring. Records wait in
+// order for ring space and credits. Returns false if the record can never
+// fit the ring.
+//
+static bool RDMARingSend(RDMAConnection* conn, const char* data, uint32_t len)
+{
+    if (len == 0 || len > (uint32_t)RDMA_RING_SIZE) {
+        return false;
+    }
+
+    if (conn->backlog->empty() && conn->ring_backlog->empty() &&
+        RDMARingCanWrite(conn, len)) {
+        RDMARingWrite(conn, data, len);
+    } else {
+        conn->ring_backlog->push_back(std::vector<char>(data, data + len));
+    }
+
+    return true;
+}
+
+//
+// Sends `len` bytes of a registered region. Payloads up to
+// RDMA_RNDV_THRESHOLD are copied through the write ring and released at
+// once; larger ones are read by the peer, so the region must stay intact
+// until send_done_handler fires with `cookie`.
+//
+static bool RDMASendRegion(RDMAConnection* conn, const char* addr, uint32_t len,
+                           struct ibv_mr* mr, uint64_t cookie)
+{
+    if (len <= RDMA_RNDV_THRESHOLD) {
+        if (!RDMARingSend(conn, addr, len)) {
+            return false;
+        }
+
+        if (conn->send_done_handler) {
+            conn->send_done_handler(conn, cookie, 0);
+        }
+        return true;
+    }
+
+    RDMAMessage msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = RDMAMessage::MSG_RNDV_RTS;
+    msg.data.rndv.addr   = (uintptr_t)addr;
+    msg.data.rndv.rkey   = mr->rkey;
+    msg.data.rndv.length = len;
+    msg.data.rndv.cookie = cookie;
+
+    RDMAPostMessage(conn, &msg);
+
+    return true;
+}
+
+static void RDMASendRndvFin(RDMAConnection* conn, uint64_t cookie, int status)
+{
+    RDMAMessage msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = RDMAMessage::MSG_RNDV_FIN;
+    msg.data.rndv.cookie = cookie;
+    msg.data.rndv.status = status;
+
+    RDMAPostMessage(conn, &msg);
+}
+
+//
+// Reads an advertised payload straight into its destination. The read
+// takes a send queue slot like any other work request, see RDMAPostRndvRead().
+//
+static void RDMAStartRndvRead(RDMAConnection* conn, RDMARndvRead* rd)
+{
+    uint32_t lkey;
+
+    if (!conn->rndv_target_handler ||
+        !conn->rndv_target_handler(conn, rd->length, &rd->addr, &lkey)) {
+        if (rd->length > ((size_t)1 << RDMA_POOL_MAX_SHIFT)) {
+            RDMASendRndvFin(conn, rd->cookie, -EMSGSIZE);
+            return;
+        }
+
+        rd->buf  = RDMAPoolGet(conn->ctx->pool, rd->length);
+        rd->addr = (char*)rd->buf->addr;
+        lkey     = rd->buf->mr->lkey;
+    }
+
+    struct ibv_send_wr wr;
+    struct ibv_send_wr *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    memset(&wr, 0, sizeof(wr));
+
+    // Reads consume no receive on the peer, so they need no credit.
+    wr.wr_id = RDMA_SEND_WR_ID;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = RDMASignaledSendFlags(conn, NULL);
+    wr.wr.rdma.remote_addr = rd->remote_addr;
+    wr.wr.rdma.rkey = rd->rkey;
+
+    sge.addr = (uintptr_t)rd->addr;
+    sge.length = rd->length;
+    sge.lkey = lkey;
+
+    int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+    assert(!ret);
+
+    conn->rndv_reads->push_back(*rd);
+}
+
+//
+// Starts the read a MSG_RNDV_RTS asks for, or queues it until the send
+// queue has room. A batch of RTS messages may well outnumber the slots.
+//
+static void RDMAPostRndvRead(RDMAConnection* conn, const RDMAMessage* msg)
+{
+    RDMARndvRead rd;
+
+    rd.addr        = NULL;
+    rd.length      = msg->data.rndv.length;
+    rd.cookie      = msg->data.rndv.cookie;
+    rd.buf         = NULL;
+    rd.remote_addr = msg->data.rndv.addr;
+    rd.rkey        = msg->data.rndv.rkey;
+
+    if (conn->rndv_backlog->empty() && RDMASendQueueHasRoom(conn)) {
+        RDMAStartRndvRead(conn, &rd);
+    } else {
+        conn->rndv_backlog->push_back(rd);
+    }
+}
+
+//
+// Delivers the oldest rendezvous read, which just completed, and lets the
+// sender reuse its region.
+//
+static void RDMAFinishRndvRead(RDMAConnection* conn)
+{
+    assert(!conn->rndv_reads->empty());
+    RDMARndvRead rd = conn->rndv_reads->front();
+    conn->rndv_reads->pop_front();
+
+    if (conn->recv_handler) {
+        conn->recv_handler(conn, rd.addr, rd.length);
+    }
+
+    if (rd.buf) {
+        RDMAPoolPut(rd.buf);
+    }
+
+    RDMASendRndvFin(conn, rd.cookie, 0);
+}
+
+//
+// Stops (or restarts) handing consumed receives and ring space back to the
+// peer, so a slow reader throttles the sender end to end.
+//
+static void RDMASetPaused(RDMAConnection* conn, bool paused)
+{
+    conn->rx_paused = paused;
+
+    if (!paused) {
+        RDMAFlushBacklog(conn);
+    }
+}
+
+//
+// Whether sends are waiting in a backlog. Marks the connection so the drain
+// handler runs once they went out.
+//
+static bool RDMATxBlocked(RDMAConnection* conn)
+{
+    conn->tx_blocked = !conn->backlog->empty() || !conn->ring_backlog->empty();
+
+    return conn->tx_blocked;
+}
+
+static void RDMASendMR(void *context)
+{
+    RDMAConnection* conn = (RDMAConnection*)context;
+    RDMAMessage     msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = RDMAMessage::MSG_MR;
+    memcpy(&msg.data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
+
+    // The MR covers the whole pool slab; advertise only our region of it.
+    msg.data.mr.addr   = conn->rdma_remote_region;
+    msg.data.mr.length = conn->rdma_remote_buf->length;
+
+    RDMAPostMessage(conn, &msg);
+}
+
+
+//
+// Both sides advertise their ring as soon as the connection is up; the
+// ring cannot be written before the peer's MR has arrived. Anything sent
+// earlier went to the backlogs and goes out now.
+//
+static void OnConnect(void* context)
+{
+    RDMAConnection* conn = (RDMAConnection*)context;
+
+    conn->connected = 1;
+    RDMASendMR(conn);
+    RDMAFlushBacklog(conn);
+    RDMANotifyDrain(conn);
+}
+
+static void RDMAQueueCompletion(RDMA* owner, const struct ibv_wc* wc);
+static void RDMAFlushCompletions();
+
+//
+// Handles the message in conn->recv_msg.
+//
+static void RDMAHandleMessage(RDMAConnection* conn)
+{
+    RDMAMessage* msg = conn->recv_msg;
+
+    conn->send_credits   += msg->credits;
+    conn->ring_peer_head += msg->ring_consumed;
+
+    switch (msg->type) {
+    case RDMAMessage::MSG_MR:
+        conn->recv_state = RDMAConnection::NextRecvState(conn->recv_state);
+        memcpy(&conn->peer_mr, &msg->data.mr, sizeof(conn->peer_mr));
+        break;
+    case RDMAMessage::MSG_DONE:
+        conn->recv_state = RDMAConnection::NextRecvState(conn->recv_state);
+
+        if (conn->end_handler) {
+            conn->end_handler(conn);
+        }
+        break;
+    case RDMAMessage::MSG_CREDIT:
+        break;
+    case RDMAMessage::MSG_RNDV_RTS:
+        RDMAPostRndvRead(conn, msg);
+        break;
+    case RDMAMessage::MSG_RNDV_FIN:
+        if (conn->send_done_handler) {
+            conn->send_done_handler(conn, msg->data.rndv.cookie, msg->data.rndv.status);
+        }
+        break;
+    case RDMAMessage::MSG_EXPOSE:
+        conn->peer_expose_addr   = msg->data.expose.addr;
+        conn->peer_expose_rkey   = msg->data.expose.rkey;
+        conn->peer_expose_length = msg->data.expose.length;
+
+        if (conn->expose_handler) {
+            conn->expose_handler(conn);
+        }
+        break;
+    }
+}
+
+//
+// Consumes the record a RDMA_WRITE_WITH_IMM doorbell announced, in place.
+//
+static void RDMAHandleRingWrite(RDMAConnection* conn, uint32_t len)
+{
+    uint32_t size = conn->rdma_remote_buf->length;
+    uint32_t span = RDMARingSpan(conn->ring_head, size, len);
+    uint32_t off  = (conn->ring_head + span - len) % size;
+
+    if (conn->recv_handler) {
+        conn->recv_handler(conn, conn->rdma_remote_region + off, len);
+    }
+
+    conn->ring_head      += span;
+    conn->ring_to_return += span;
+}
+
+//
+// Handles a failed work completion. The QP is in the error state, so
+// nothing is reposted: SRQ receives go back to the SRQ, receives of our
+// own ring stay with it until RDMADestroyConnection() returns them to the
+// pool.
+//
+// Unsignaled sends are flushed with completions of their own, so these do
+// not map to signaled_batches. Only the first error fails the oldest
+// batch's operation with its status; RDMADestroyConnection() fails the
+// rest. Flushed WRs (IBV_WC_WR_FLUSH_ERR) are the normal result of a
+// disconnect. Any other error breaks the connection, which is then
+// disconnected so the DISCONNECTED event tears it down.
+//
+static void RDMAFailCompletion(RDMAConnection* conn, struct ibv_wc* wc, RDMABuffer* buf)
+{
+    if (buf && conn->ctx->srq) {
+        RDMARecycleSRQReceive(conn->ctx, buf);
+    }
+
+    if (!conn->connected) {
+        return;
+    }
+
+    // No more posts on this QP; whatever is sent now waits in the backlogs
+    // until the connection is destroyed.
+    conn->connected = 0;
+
+    if (!buf && !conn->signaled_batches->empty()) {
+        RDMASignaledBatch batch = conn->signaled_batches->front();
+        conn->signaled_batches->pop_front();
+
+        if (batch.op) {
+            RDMAFinishOp(conn, batch.op, wc->status);
+        }
+    }
+
+    if (wc->status != IBV_WC_WR_FLUSH_ERR) {
+        fprintf(stderr, "Work completion failed on QP %u: %s\n",
+                wc->qp_num, ibv_wc_status_str(wc->status));
+        rdma_disconnect(conn->id);
+    }
+}
+
+//
+// Handles a work completion reaped at context epoch `epoch`.
+//
+static void OnCompletion(RDMAContext* ctx, struct ibv_wc* wc, uint32_t epoch)
+{
+    RDMAConnection* conn;
+    RDMABuffer*     buf = NULL;
+    bool            recv;
+
+    // The opcode is undefined for error completions, so those are told
+    // apart by wr_id: receives carry their pool buffer in it, sends
+    // RDMA_SEND_WR_ID.
+    if (wc->status == IBV_WC_SUCCESS) {
+        recv = (wc->opcode & IBV_WC_RECV) != 0;
+    } else {
+        recv = wc->wr_id != RDMA_SEND_WR_ID;
+    }
+
+    if (recv) {
+        buf = (RDMABuffer*)(uintptr_t)wc->wr_id;
+
+        if (ctx->srq) {
+            ctx->srq_posted--;
+        }
+    }
+
+    // The connection is found by QP number, which works the same for SRQ
+    // receives. Completions reaped by a CQ worker may be handled after
+    // their connection was destroyed, so sends are looked up the same way
+    // rather than trusting wr_id. A completion older than the connection
+    // belongs to a destroyed one which had the same QP number.
+    std::map<uint32_t, RDMAConnection*>::iterator it = ctx->qp_table->find(wc->qp_num);
+    if (it == ctx->qp_table->end() || (int32_t)(epoch - it->second->epoch) < 0) {
+        // The connection is gone; its own ring went back with it.
+        if (buf && ctx->srq) {
+            RDMARecycleSRQReceive(ctx, buf);
+        }
+        return;
+    }
+
+    conn = it->second;
+
+    if (conn->owner) {
+        RDMAQueueCompletion(conn->owner, wc);
+    }
+
+    if (wc->status != IBV_WC_SUCCESS) {
+        RDMAFailCompletion(conn, wc, buf);
+        return;
+    }
+
+    if (buf) {
+        if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            // Ring doorbell; the receive buffer itself was not written.
+            RDMAHandleRingWrite(conn, ntohl(wc->imm_data));
+        } else {
+            conn->recv_msg = (RDMAMessage*)buf->addr;
+            RDMAHandleMessage(conn);
+            conn->recv_msg = NULL;
+        }
+
+        // The receive is reposted, on our QP or the SRQ, before it is owed
+        // to the peer as a credit.
+        if (ctx->srq) {
+            RDMARecycleSRQReceive(ctx, buf);
+        } else {
+            RDMAPostReceive(conn, buf);
+        }
+        conn->credits_to_return++;
+    } else {
+        // A signaled send completion also stands for the unsignaled sends
+        // posted before it.
+        assert(!conn->signaled_batches->empty());
+        RDMASignaledBatch batch = conn->signaled_batches->front();
+        conn->signaled_batches->pop_front();
+        conn->sends_outstanding -= batch.sends;
+
+        for (uint32_t i = 0; i < batch.sends; i++) {
+            conn->send_state = RDMAConnection::NextSendState(conn->send_state);
+        }
+
+        // A send is signaled whenever no signaled one is outstanding, so
+        // this only happens when the send queue went idle behind unsignaled
+        // sends.
+        if (conn->signaled_batches->empty() && conn->sends_since_signal > 0) {
+            RDMAPostFlush(conn);
+        }
+
+        // Reads are always signaled and complete in posting order.
+        if (batch.op) {
+            RDMAFinishOp(conn, batch.op, IBV_WC_SUCCESS);
+        } else if (wc->opcode == IBV_WC_RDMA_READ) {
+            RDMAFinishRndvRead(conn);
+        }
+    }
+
+    // Credits arrived or send queue slots were retired.
+    RDMAFlushBacklog(conn);
+    RDMANotifyDrain(conn);
+}
+
+//
+// Updates the interarrival estimate of the CQ after `n` completions and
+// derives the busy-poll budget from it.
+//
+static void RDMAUpdatePollBudget(RDMACQ* cq, int n)
+{
+    uint64_t now = uv_hrtime();
+    uint64_t interval = (now - cq->last_completion_ns) / n;
+    cq->last_completion_ns = now;
+
+    // EWMA with alpha = 1/8.
+    cq->avg_interval_ns = (7 * cq->avg_interval_ns + interval) / 8;
+
+    // Spin for a couple of interarrival periods. If completions are
+    // further apart than the ceiling, busy polling cannot win and we
+    // stay interrupt driven.
+    uint64_t budget = 2 * cq->avg_interval_ns;
+    if (budget > g_poll_config.max_budget_ns) {
+        cq->spin_budget_ns = 0;
+    } else if (budget < g_poll_config.min_budget_ns) {
+        cq->spin_budget_ns = g_poll_config.min_budget_ns;
+    } else {
+        cq->spin_budget_ns = budget;
+    }
+}
+
+//
+// Polls every available work completion off the CQ and handles it.
+//
+static int RDMADrainCQ(RDMACQ* cq)
+{
+    int batch = g_poll_config.wc_batch;
+    int n = 0;
+    int ret;
+
+    do {
+        ret = ibv_poll_cq(cq->cq, batch, cq->wcs);
+        assert(ret >= 0);
+
+        for (int i = 0; i < ret; i++) {
+            OnCompletion(cq->ctx, &cq->wcs[i], cq->ctx->epoch);
+        }
+
+        n += ret;
+    } while (ret == batch);
+
+    if (n > 0) {
+        RDMAUpdatePollBudget(cq, n);
+    }
+
+    return n;
+}
+
+//
+// Re-arms CQ notification and leaves busy-poll mode. Completions which raced
+// with the re-arm are drained here, since they do not generate an event.
+//
+static void RDMAArmCQ(RDMACQ* cq)
+{
+    if (cq->spinning) {
+        uv_idle_stop(&cq->spin_handle);
+        cq->spinning = false;
+    }
+
+    int ret = ibv_req_notify_cq(cq->cq, 0);
+    assert(!ret);
+
+    RDMADrainCQ(cq);
+}
+
+static void OnCQSpin(uv_idle_t* handle, int status)
+{
+    RDMACQ* cq = (RDMACQ*)handle->data;
+
+    RDMADrainCQ(cq);
+
+    if (uv_hrtime() - cq->last_completion_ns >= cq->spin_budget_ns) {
+        RDMAArmCQ(cq);
+    }
+
+    RDMAFlushCompletions();
+}
+
+//
+// Drains the completion channel on the loop thread. The channel fd is
+// non-blocking, so every pending CQ event is consumed here and we return to
+// the loop as soon as ibv_get_cq_event() reports EAGAIN.
+//
+// Notification is not re-armed immediately: when the completion rate is high
+// enough the CQ is busy-polled by an idle handle and only re-armed once it
+// has been quiet for the current budget.
+//
+static void OnCompChannelReadable(uv_poll_t* handle, int status, int events)
+{
+    RDMACQ*         cq = (RDMACQ*)handle->data;
+    struct ibv_cq*  ev_cq;
+    void*           cq_context;
+
+    if (status < 0) {
+        fprintf(stderr, "Failed to poll completion channel\n");
+        return;
+    }
+
+    while (ibv_get_cq_event(cq->comp_channel, &ev_cq, &cq_context) == 0) {
+        cq->unacked_events++;
+        RDMADrainCQ(cq);
+    }
+
+    assert(errno == EAGAIN);
+
+    if (cq->unacked_events >= RDMA_CQ_ACK_THRESHOLD) {
+        ibv_ack_cq_events(cq->cq, cq->unacked_events);
+        cq->unacked_events = 0;
+    }
+
+    if (!cq->spinning) {
+        if (cq->spin_budget_ns > 0) {
+            uv_idle_start(&cq->spin_handle, OnCQSpin);
+            cq->spinning = true;
+        } else {
+            RDMAArmCQ(cq);
+        }
+    }
+
+    RDMAFlushCompletions();
+}
+
+static void RDMASetNonBlocking(int fd, const char* what)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Failed to set %s non-blocking\n", what);
+        exit(-1);
+    }
+}
+
+static void RDMAResetPollState(RDMACQ* cq)
+{
+    cq->spinning           = false;
+    cq->spin_budget_ns     = g_poll_config.max_budget_ns;
+    cq->avg_interval_ns    = g_poll_config.max_budget_ns;
+    cq->last_completion_ns = uv_hrtime();
+    cq->unacked_events     = 0;
+}
+
+//
+// Registers the completion channel of the CQ with the libuv loop.
+//
+static void RDMAStartPolling(RDMACQ* cq)
+{
+    int fd = cq->comp_channel->fd;
+
+    RDMASetNonBlocking(fd, "completion channel");
+
+    int ret = uv_poll_init(uv_default_loop(), &cq->poll_handle, fd);
+    assert(ret == 0);
+    cq->poll_handle.data = cq;
+
+    ret = uv_poll_start(&cq->poll_handle, UV_READABLE, OnCompChannelReadable);
+    assert(ret == 0);
+
+    ret = uv_idle_init(uv_default_loop(), &cq->spin_handle);
+    assert(ret == 0);
+    cq->spin_handle.data = cq;
+
+    cq->worker = NULL;
+
+    RDMAResetPollState(cq);
+}
+
+//
+// Every CQ worker feeds the loop through one uv_async. A worker only sends
+// it when `g_wc_wakeup` goes from 0 to 1, and the loop clears the flag
+// before it drains, so a burst from any number of workers costs a single
+// wakeup and no completion is left behind.
+//
+static uv_async_t               g_wc_async;
+static bool                     g_wc_async_ready = false;
+static volatile int             g_wc_wakeup = 0;
+static std::vector<RDMACQ*>     g_wc_sources;       ///< CQs with a live worker
+
+static void RDMAWakeLoop()
+{
+    if (__sync_bool_compare_and_swap(&g_wc_wakeup, 0, 1)) {
+        uv_async_send(&g_wc_async);
+    }
+}
+
+//
+// Polls the CQ on the worker thread and publishes what it reaped to the
+// loop. A full ring stalls the worker until the loop catches up; nothing is
+// lost meanwhile, as the CQ is sized for every outstanding WR.
+//
+static int RDMAWorkerPoll(RDMACQ* cq)
+{
+    RDMACQWorker* w = cq->worker;
+    RDMAWCRecord recs[RDMA_MAX_WC_BATCH];
+    int batch = g_poll_config.wc_batch;
+    int n = 0;
+    int ret;
+
+    do {
+        // The records are complete before the lock goes, so a full ring
+        // never stalls the loop in RDMAReserveCQ().
+        pthread_mutex_lock(&w->lock);
+
+        uint32_t epoch = cq->ctx->epoch;
+        ret = ibv_poll_cq(cq->cq, batch, cq->wcs);
+        assert(ret >= 0);
+
+        for (int i = 0; i < ret; i++) {
+            recs[i].wr_id       = cq->wcs[i].wr_id;
+            recs[i].qp_num      = cq->wcs[i].qp_num;
+            recs[i].epoch       = epoch;
+            recs[i].byte_len    = cq->wcs[i].byte_len;
+            recs[i].imm_data    = cq->wcs[i].imm_data;
+            recs[i].status      = cq->wcs[i].status;
+            recs[i].opcode      = cq->wcs[i].opcode;
+        }
+
+        pthread_mutex_unlock(&w->lock);
+
+        uint32_t pushed = 0;
+        while (pushed < (uint32_t)ret) {
+            pushed += RDMAWCRingPush(w->ring, recs + pushed, ret - pushed);
+
+            if (pushed < (uint32_t)ret) {
+                RDMAWakeLoop();
+                sched_yield();
+            }
+        }
+
+        n += ret;
+    } while (ret == batch);
+
+    if (n > 0) {
+        RDMAWakeLoop();
+        RDMAUpdatePollBudget(cq, n);
+    }
+
+    return n;
+}
+
+static void* RDMACQWorkerMain(void* arg)
+{
+    RDMACQ*         cq = (RDMACQ*)arg;
+    RDMACQWorker*   w  = cq->worker;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            fprintf(stderr, "Failed to pin CQ %d to cpu %d\n", cq->index, w->cpu);
+        }
+    }
+
+    while (!w->stop) {
+        if (RDMAWorkerPoll(cq) > 0 ||
+            uv_hrtime() - cq->last_completion_ns < cq->spin_budget_ns) {
+            continue;
+        }
+
+        // Quiet for the budget: arm, catch what raced with the arm, sleep.
+        pthread_mutex_lock(&w->lock);
+        int ret = ibv_req_notify_cq(cq->cq, 0);
+        pthread_mutex_unlock(&w->lock);
+        assert(!ret);
+
+        if (RDMAWorkerPoll(cq) > 0) {
+            continue;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd       = cq->comp_channel->fd;
+        fds[0].events   = POLLIN;
+        fds[1].fd       = w->wake_pipe[0];
+        fds[1].events   = POLLIN;
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to poll completion channel\n");
+        }
+
+        struct ibv_cq*  ev_cq;
+        void*           cq_context;
+        while (ibv_get_cq_event(cq->comp_channel, &ev_cq, &cq_context) == 0) {
+            cq->unacked_events++;
+        }
+
+        if (cq->unacked_events >= RDMA_CQ_ACK_THRESHOLD) {
+            pthread_mutex_lock(&w->lock);
+            ibv_ack_cq_events(cq->cq, cq->unacked_events);
+            pthread_mutex_unlock(&w->lock);
+            cq->unacked_events = 0;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Handles, on the loop, everything the CQ workers published since the
+// last wakeup.
+//
+static void OnWorkerCompletions(uv_async_t* handle, int status)
+{
+    RDMAWCRecord recs[RDMA_MAX_WC_BATCH];
+
+    g_wc_wakeup = 0;
+    __sync_synchronize();   // Clear before draining, see g_wc_wakeup
+
+    for (size_t i = 0; i < g_wc_sources.size(); i++) {
+        RDMACQ* cq = g_wc_sources[i];
+        uint32_t n;
+
+        while ((n = RDMAWCRingPop(cq->worker->ring, recs, RDMA_MAX_WC_BATCH)) > 0) {
+            for (uint32_t j = 0; j < n; j++) {
+                struct ibv_wc wc;
+                memset(&wc, 0, sizeof(wc));
+                wc.wr_id    = recs[j].wr_id;
+                wc.qp_num   = recs[j].qp_num;
+                wc.byte_len = recs[j].byte_len;
+                wc.imm_data = recs[j].imm_data;
+                wc.status   = (enum ibv_wc_status)recs[j].status;
+                wc.opcode   = (enum ibv_wc_opcode)recs[j].opcode;
+
+                OnCompletion(cq->ctx, &wc, recs[j].epoch);
+            }
+        }
+    }
+
+    RDMAFlushCompletions();
+}
+
+static void RDMAStartWorker(RDMACQ* cq)
+{
+    if (!g_wc_async_ready) {
+        uv_async_init(uv_default_loop(), &g_wc_async, OnWorkerCompletions);
+        // Only live workers keep the loop alive, see g_wc_sources.
+        uv_unref((uv_handle_t*)&g_wc_async);
+        g_wc_async_ready = true;
+    }
+
+    RDMACQWorker* w = new RDMACQWorker();
+
+    const std::vector<int>* cpus = g_cq_config.cpus;
+    w->cpu  = (cpus && !cpus->empty()) ? (*cpus)[cq->index % cpus->size()] : -1;
+    w->stop = false;
+
+    int ret = pthread_mutex_init(&w->lock, NULL);
+    assert(ret == 0);
+
+    ret = pipe(w->wake_pipe);
+    assert(ret == 0);
+    RDMASetNonBlocking(w->wake_pipe[0], "CQ wake pipe");
+
+    RDMASetNonBlocking(cq->comp_channel->fd, "completion channel");
+
+    void* ring;
+    ret = posix_memalign(&ring, 64, sizeof(RDMAWCRing));
+    assert(ret == 0);
+    w->ring = (RDMAWCRing*)ring;
+    w->ring->head = 0;
+    w->ring->tail = 0;
+
+    cq->worker = w;
+    RDMAResetPollState(cq);
+
+    g_wc_sources.push_back(cq);
+    if (g_wc_sources.size() == 1) {
+        uv_ref((uv_handle_t*)&g_wc_async);
+    }
+
+    ret = pthread_create(&w->thread, NULL, RDMACQWorkerMain, cq);
+    assert(ret == 0);
+}
+
+//
+// Stops and joins the worker. Records it left in the ring are dropped;
+// their connections are gone.
+//
+static void RDMAStopWorker(RDMACQ* cq)
+{
+    RDMACQWorker* w = cq->worker;
+
+    w->stop = true;
+
+    char c = 0;
+    ssize_t ret = write(w->wake_pipe[1], &c, 1);
+    (void)ret;
+
+    pthread_join(w->thread, NULL);
+
+    g_wc_sources.erase(std::find(g_wc_sources.begin(), g_wc_sources.end(), cq));
+    if (g_wc_sources.empty()) {
+        uv_unref((uv_handle_t*)&g_wc_async);
+    }
+
+    close(w->wake_pipe[0]);
+    close(w->wake_pipe[1]);
+    pthread_mutex_destroy(&w->lock);
+    free(w->ring);
+    w->ring = NULL;
+}
+
+//
+// Connection parameters for rdma_connect()/rdma_accept(). Rendezvous reads
+// and atomics need both sides to allow outstanding RDMA READ/atomic
+// operations; the CM turns these into the QP's max_rd_atomic and
+// max_dest_rd_atomic, which must not exceed what the device supports.
+//
+static void RDMABuildConnParam(struct rdma_conn_param* param, struct ibv_context* verbs)
+{
+    struct ibv_device_attr attr;
+    int ret = ibv_query_device(verbs, &attr);
+    assert(ret == 0);
+
+    memset(param, 0, sizeof(*param));
+
+    param->initiator_depth      = std::min<int>(RDMA_RD_ATOMIC_DEPTH, attr.max_qp_init_rd_atom);
+    param->responder_resources  = std::min<int>(RDMA_RD_ATOMIC_DEPTH, attr.max_qp_rd_atom);
+    param->rnr_retry_count      = 7;    // Infinite; credits make RNR rare
+}
+
+//
+// The errno of the last failed libuv call on the default loop, negated.
+//
+static int RDMAUVError()
+{
+    uv_err_t err = uv_last_error(uv_default_loop());
+    return err.sys_errno_ ? -err.sys_errno_ : -EIO;
+}
+
+//
+// Outgoing connections of one RDMA object. All of them share an event
+// channel watched by the loop, so any number of connects can be in flight;
+// each walks ADDR_RESOLVED -> ROUTE_RESOLVED -> ESTABLISHED and is reported
+// through the connect callback with the caller's `req`.
+//
+class
+RDMAClientContext
+{
+public:
+
+  // conn is NULL and status a negative errno if the connect failed.
+  typedef void (*ConnectCallback)(void* arg, void* req, RDMAConnection* conn, int status);
+
+  //
+  // Returns 0 or a negative errno. A context which failed to initialize is
+  // disposed of with close() all the same.
+  //
+  int init() {
+
+    ec = rdma_create_event_channel();
+    if (!ec) {
+      return -errno;
+    }
+
+    int flags = fcntl(ec->fd, F_GETFL);
+    int ret = fcntl(ec->fd, F_SETFL, flags | O_NONBLOCK);
+    assert(ret == 0);
+
+    poll_handle.data = this;
+    if (uv_poll_init(uv_default_loop(), &poll_handle, ec->fd)) {
+      return RDMAUVError();
+    }
+    poll_initialized = true;
+
+    if (uv_poll_start(&poll_handle, UV_READABLE, OnEventChannelReadable)) {
+      return RDMAUVError();
+    }
+
+    return 0;
+  }
+
+  RDMAClientContext() : ec(NULL), poll_initialized(false), on_connect(NULL),
+                        on_connect_arg(NULL), established(0), failed(0) {
+  }
+
+  void setConnectCallback(ConnectCallback cb, void* arg) {
+    on_connect = cb;
+    on_connect_arg = arg;
+  }
+
+  //
+  // Starts connecting to ipaddr:port. Returns 0, or a negative errno if
+  // the connect could not even be started.
+  //
+  int connect(const char* ipaddr, int port, void* req) {
+
+    struct addrinfo* addr;
+
+    char buf[1024];
+    sprintf(buf, "%d", port);
+
+    int ret;
+    ret = getaddrinfo(ipaddr, buf, NULL, &addr);
+    if (ret != 0) {
+      return -EHOSTUNREACH;
+    }
+
+    struct rdma_cm_id* id;
+    ret = rdma_create_id(ec, &id, NULL, RDMA_PS_TCP);
+    assert(!ret);
+
+    int TIMEOUT_IN_MS = 500; // Arbitraray
+    ret = rdma_resolve_addr(id, NULL, addr->ai_addr, TIMEOUT_IN_MS);
+
+    freeaddrinfo(addr);
+
+    if (ret) {
+      ret = -errno;
+      rdma_destroy_id(id);
+      return ret;
+    }
+
+    pending[id] = req;
+
+    return 0;
+  }
+
+  size_t numConnections() const { return connections.size(); }
+  size_t numPending() const { return pending.size(); }
+  uint64_t numEstablished() const { return established; }
+  uint64_t numFailed() const { return failed; }
+
+  //
+  // Fails pending connects with -ECANCELED and destroys every connection
+  // and the event channel. The object itself goes once the loop has
+  // closed the poll handle.
+  //
+  void close() {
+    if (poll_initialized) {
+      uv_poll_stop(&poll_handle);
+    }
+
+    while (!pending.empty()) {
+      struct rdma_cm_id* id = pending.begin()->first;
+      complete(id, NULL, -ECANCELED);
+
+      // Ids past ADDR_RESOLVED go with their connection below.
+      if (!id->context) {
+        rdma_destroy_id(id);
+      }
+    }
+
+    while (!connections.empty()) {
+      RDMAConnection* conn = connections.back();
+      removeConnection(conn);
+      RDMADestroyConnection(conn);
+    }
+
+    RDMAReleaseHeldContexts(&contexts);
+
+    if (ec) {
+      rdma_destroy_event_channel(ec);
+      ec = NULL;
+    }
+
+    if (poll_initialized) {
+      uv_close((uv_handle_t*)&poll_handle, OnPollClosed);
+    } else {
+      delete this;
+    }
+  }
+
+
+private:
+
+  ~RDMAClientContext() { }
+
+  static void OnPollClosed(uv_handle_t* handle) {
+    delete (RDMAClientContext*)handle->data;
+  }
+
+  static void OnEventChannelReadable(uv_poll_t* handle, int status, int events) {
+    RDMAClientContext* client = (RDMAClientContext*)handle->data;
+    struct rdma_cm_event* event;
+
+    if (status < 0) {
+      fprintf(stderr, "Failed to poll CM event channel\n");
+      return;
+    }
+
+    while (rdma_get_cm_event(client->ec, &event) == 0) {
+      // Ack first, ids may be destroyed while handling the event.
+      struct rdma_cm_event ev = *event;
+      rdma_ack_cm_event(event);
+
+      client->handleEvent(&ev);
+    }
+
+    assert(errno == EAGAIN);
+  }
+
+  void handleEvent(struct rdma_cm_event* ev) {
+    struct rdma_cm_id* id = ev->id;
+    RDMAConnection* conn = (RDMAConnection*)id->context;
+
+    switch (ev->event) {
+    case RDMA_CM_EVENT_ADDR_RESOLVED:
+      {
+        RDMAContext* ctx = RDMAAcquireContext(id->verbs);
+        RDMAHoldContext(&contexts, ctx);
+        conn = Connection(ctx, id);
+        addConnection(conn);
+
+        int TIMEOUT_IN_MS = 500;
+        if (rdma_resolve_route(id, TIMEOUT_IN_MS)) {
+          fail(id, -errno);
+        }
+      }
+      break;
+    case RDMA_CM_EVENT_ROUTE_RESOLVED:
+      {
+        struct rdma_conn_param param;
+        RDMABuildConnParam(&param, id->verbs);
+
+        if (rdma_connect(id, &param)) {
+          fail(id, -errno);
+        }
+      }
+      break;
+    case RDMA_CM_EVENT_ESTABLISHED:
+      if (!conn) {
+        break;
+      }
+      OnConnect(conn);
+      established++;
+      complete(id, conn, 0);
+      break;
+    case RDMA_CM_EVENT_ADDR_ERROR:
+    case RDMA_CM_EVENT_ROUTE_ERROR:
+    case RDMA_CM_EVENT_CONNECT_ERROR:
+    case RDMA_CM_EVENT_UNREACHABLE:
+      fail(id, ev->status < 0 ? ev->status : -EHOSTUNREACH);
+      break;
+    case RDMA_CM_EVENT_REJECTED:
+      fail(id, -ECONNREFUSED);
+      break;
+    case RDMA_CM_EVENT_DISCONNECTED:
+      if (conn) {
+        removeConnection(conn);
+        RDMADestroyConnection(conn);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  void complete(struct rdma_cm_id* id, RDMAConnection* conn, int status) {
+    std::map<struct rdma_cm_id*, void*>::iterator it = pending.find(id);
+    if (it == pending.end()) {
+      return;
+    }
+
+    void* req = it->second;
+    pending.erase(it);
+
+    if (on_connect) {
+      on_connect(on_connect_arg, req, conn, status);
+    }
+  }
+
+  // Gives up on a connect which has not been established.
+  void fail(struct rdma_cm_id* id, int status) {
+    RDMAConnection* conn = (RDMAConnection*)id->context;
+
+    failed++;
+    complete(id, NULL, status);
+
+    if (conn) {
+      removeConnection(conn);
+      RDMADestroyConnection(conn);
+    } else {
+      rdma_destroy_id(id);
+    }
+  }
+
+  void addConnection(RDMAConnection* conn) {
+    conn->table_index = connections.size();
+    connections.push_back(conn);
+  }
+
+  void removeConnection(RDMAConnection* conn) {
+    int i = conn->table_index;
+    if (i < 0) {
+      return;
+    }
+
+    connections[i] = connections.back();
+    connections[i]->table_index = i;
+    connections.pop_back();
+
+    conn->table_index = -1;
+  }
+
+  struct rdma_event_channel*  ec;
+
+  uv_poll_t                   poll_handle;    ///< Watches ec->fd
+  bool                        poll_initialized;
+
+  std::map<struct rdma_cm_id*, void*>  pending;       ///< Connects in flight -> req
+  std::vector<RDMAConnection*>          connections;  ///< Created and not yet disconnected
+  std::vector<RDMAContext*>             contexts;     ///< Held, see RDMAHoldContext()
+  ConnectCallback             on_connect;
+  void*                       on_connect_arg;
+
+  uint64_t                    established;
+  uint64_t                    failed;
+
+};
+
+//
+// Passive side. Accepts connections continuously from the loop: the CM
+// event channel is watched with uv_poll and every pending event is handled
+// per wakeup, so a reconnect storm costs one loop iteration per batch
+// rather than per event.
+//
+class
+RDMAServerContext
+{
+public:
+
+  typedef void (*ConnectionCallback)(void* arg, RDMAConnection* conn);
+
+  //
+  // Returns 0 or a negative errno, see RDMAClientContext::init().
+  //
+  int init(int backlog) {
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    ec = rdma_create_event_channel();
+    if (!ec) {
+      return -errno;
+    }
+
+    if (rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP) ||
+        rdma_bind_addr(listener, (struct sockaddr *)&addr) ||
+        rdma_listen(listener, backlog)) {
+      return -errno;
+    }
+
+    port = ntohs(rdma_get_src_port(listener));
+
+    int flags = fcntl(ec->fd, F_GETFL);
+    int ret = fcntl(ec->fd, F_SETFL, flags | O_NONBLOCK);
+    assert(ret == 0);
+
+    poll_handle.data = this;
+    if (uv_poll_init(uv_default_loop(), &poll_handle, ec->fd)) {
+      return RDMAUVError();
+    }
+    poll_initialized = true;
+
+    if (uv_poll_start(&poll_handle, UV_READABLE, OnEventChannelReadable)) {
+      return RDMAUVError();
+    }
+
+    return 0;
+  }
+
+  RDMAServerContext() : ec(NULL), listener(NULL), port(0), srq_depth(0),
+                        poll_initialized(false), on_connection(NULL),
+                        on_connection_arg(NULL), accepted(0), rejected(0), failed(0) {
+  }
+
+  //
+  // Makes accepted connections share one receive queue of `depth` buffers
+  // per device, refilled when fewer than a quarter remain posted.
+  //
+  void enableSRQ(uint32_t depth) {
+    srq_depth = depth;
+  }
+
+  //
+  // Sets up SRQ on a device context used for accepted connections. This
+  // only works on a context without QPs yet: all receives on a context
+  // must come from the same place for OnCompletion() to account for them.
+  //
+  void prepareContext(RDMAContext* ctx) {
+    if (srq_depth > 0 && !ctx->srq && ctx->qp_table->empty()) {
+      RDMAEnableSRQ(ctx, srq_depth, srq_depth / 4);
+    }
+  }
+
+  //
+  // Called for every connection once it is established.
+  //
+  void setConnectionCallback(ConnectionCallback cb, void* arg) {
+    on_connection = cb;
+    on_connection_arg = arg;
+  }
+
+  size_t numConnections() const { return connections.size(); }
+  uint64_t numAccepted() const { return accepted; }
+  int localPort() const { return port; }
+  uint64_t numRejected() const { return rejected; }
+  uint64_t numFailed() const { return failed; }
+
+  //
+  // Stops listening and destroys every connection. The object itself goes
+  // once the loop has closed the poll handle.
+  //
+  void close() {
+    if (poll_initialized) {
+      uv_poll_stop(&poll_handle);
+    }
+
+    while (!connections.empty()) {
+      RDMAConnection* conn = connections.back();
+      removeConnection(conn);
+      RDMADestroyConnection(conn);
+    }
+
+    RDMAReleaseHeldContexts(&contexts);
+
+    if (listener) {
+      rdma_destroy_id(listener);
+      listener = NULL;
+    }
+    if (ec) {
+      rdma_destroy_event_channel(ec);
+      ec = NULL;
+    }
+
+    if (poll_initialized) {
+      uv_close((uv_handle_t*)&poll_handle, OnPollClosed);
+    } else {
+      delete this;
+    }
+  }
+
+
+private:
+
+  ~RDMAServerContext() { }
+
+  static void OnPollClosed(uv_handle_t* handle) {
+    delete (RDMAServerContext*)handle->data;
+  }
+
+  static void OnEventChannelReadable(uv_poll_t* handle, int status, int events) {
+    RDMAServerContext* server = (RDMAServerContext*)handle->data;
+    struct rdma_cm_event* event;
+
+    if (status < 0) {
+      fprintf(stderr, "Failed to poll CM event channel\n");
+      return;
+    }
+
+    while (rdma_get_cm_event(server->ec, &event) == 0) {
+      // Ack first: the id of a DISCONNECTED event may be destroyed while
+      // handling it, which waits for outstanding events to be acked.
+      struct rdma_cm_event ev = *event;
+      rdma_ack_cm_event(event);
+
+      server->handleEvent(&ev);
+    }
+
+    assert(errno == EAGAIN);
+  }
+
+  void handleEvent(struct rdma_cm_event* ev) {
+    RDMAConnection* conn = (RDMAConnection*)ev->id->context;
+
+    switch (ev->event) {
+    case RDMA_CM_EVENT_CONNECT_REQUEST:
+      onConnectRequest(ev->id);
+      break;
+    case RDMA_CM_EVENT_ESTABLISHED:
+      if (!conn) {
+        break;
+      }
+      OnConnect(conn);
+      if (on_connection) {
+        on_connection(on_connection_arg, conn);
+      }
+      break;
+    case RDMA_CM_EVENT_DISCONNECTED:
+      if (conn) {
+        removeConnection(conn);
+        RDMADestroyConnection(conn);
+      }
+      break;
+    case RDMA_CM_EVENT_CONNECT_ERROR:
+    case RDMA_CM_EVENT_UNREACHABLE:
+    case RDMA_CM_EVENT_REJECTED:
+    case RDMA_CM_EVENT_DEVICE_REMOVAL:
+      // An accepted connection which never came up or lost its device.
+      if (conn) {
+        removeConnection(conn);
+        RDMADestroyConnection(conn);
+        failed++;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  void onConnectRequest(struct rdma_cm_id* id) {
+    RDMAContext* ctx = RDMAAcquireContext(id->verbs);
+
+    prepareContext(ctx);
+    RDMAHoldContext(&contexts, ctx);
+
+    RDMAConnection* conn = Connection(ctx, id);
+    addConnection(conn);
+
+    struct rdma_conn_param param;
+    RDMABuildConnParam(&param, id->verbs);
+
+    if (rdma_accept(id, &param)) {
+      removeConnection(conn);
+      RDMADestroyConnection(conn);
+      rejected++;
+      return;
+    }
+
+    accepted++;
+  }
+
+  // O(1): the id's context finds the connection, the slot index removes it.
+  void addConnection(RDMAConnection* conn) {
+    conn->table_index = connections.size();
+    connections.push_back(conn);
+  }
+
+  void removeConnection(RDMAConnection* conn) {
+    int i = conn->table_index;
+    if (i < 0) {
+      return;
+    }
+
+    connections[i] = connections.back();
+    connections[i]->table_index = i;
+    connections.pop_back();
+
+    conn->table_index = -1;
+  }
+
+  struct rdma_event_channel*  ec;
+  struct rdma_cm_id*          listener;
+  int                         port;
+  uint32_t                    srq_depth;  ///< 0 = per-connection receives
+
+  uv_poll_t                   poll_handle;    ///< Watches ec->fd
+  bool                        poll_initialized;
+
+  std::vector<RDMAConnection*> connections;   ///< Accepted and not yet disconnected
+  std::vector<RDMAContext*>    contexts;      ///< Held, see RDMAHoldContext()
+  ConnectionCallback          on_connection;
+  void*                       on_connection_arg;
+
+  uint64_t                    accepted;
+  uint64_t                    rejected;
+  uint64_t                    failed;     ///< Accepted, then lost before DISCONNECTED
+
+};
+
+//
+// Returns NULL and sets *err to a negative errno if the listener or its
+// poll handle can't be set up.
+//
+static RDMAServerContext* RDMACreateServerContext(int backlog, int* err)
+{
+  RDMAServerContext* sctx = new RDMAServerContext();
+
+  *err = sctx->init(backlog);
+  if (*err) {
+    sctx->close();
+    return NULL;
+  }
+
+  return sctx;
+}
+
+static RDMAClientContext* RDMACreateClientContext(int* err)
+{
+  RDMAClientContext* cctx = new RDMAClientContext();
+
+  *err = cctx->init();
+  if (*err) {
+    cctx->close();
+    return NULL;
+  }
+
+  return cctx;
+}
+
+
+class EioData
+{
+public:
+    EioData();
+    ~EioData();
+};
+
+
+Persistent<Function> rdmaConstructor;
+
+static Persistent<String> family_symbol;
+static Persistent<String> address_symbol;
+static Persistent<String> port_symbol;
+static Persistent<String> status_symbol;
+static Persistent<String> opcode_symbol;
+static Persistent<String> byte_len_symbol;
+static Persistent<String> qp_num_symbol;
+
+// Owners with completions waiting to be delivered in this loop tick.
+static std::vector<RDMA*> g_pending_owners;
+
+class RDMA : public node::ObjectWrap {
+public:
+
+  static void Initialize(Handle<Object> target) {
+
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    t->SetClassName(String::NewSymbol("RDMA"));
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+
+
+    // API
+    NODE_SET_PROTOTYPE_METHOD(t, "server", Server);
+    NODE_SET_PROTOTYPE_METHOD(t, "client", Client);
+    NODE_SET_PROTOTYPE_METHOD(t, "close", Close);
+    NODE_SET_PROTOTYPE_METHOD(t, "server_stats", ServerStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "client_stats", ClientStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_poll_budget", SetPollBudget);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_poll_batch", SetPollBatch);
+    NODE_SET_PROTOTYPE_METHOD(t, "pool_stats", PoolStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_qp_caps", SetQPCaps);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_signal_interval", SetSignalInterval);
+    NODE_SET_PROTOTYPE_METHOD(t, "set_cqs", SetCQs);
+
+
+    rdmaConstructor = Persistent<Function>::New(t->GetFunction());
+
+    family_symbol = NODE_PSYMBOL("family");
+    address_symbol = NODE_PSYMBOL("address");
+    port_symbol = NODE_PSYMBOL("port");
+    status_symbol = NODE_PSYMBOL("status");
+    opcode_symbol = NODE_PSYMBOL("opcode");
+    byte_len_symbol = NODE_PSYMBOL("byte_len");
+    qp_num_symbol = NODE_PSYMBOL("qp_num");
+
+    target->Set(String::NewSymbol("RDMA"), rdmaConstructor);
+
+  }
+
+  int val;
+  RDMAContext ctx;
+  RDMAServerContext* serverCtx;
+  RDMAClientContext* clientCtx;
+
+  std::vector<RDMACompletion> completions_;   ///< Reaped in the current tick
+  bool                        completions_pending_;
+
+  //
+  // Hands every completion reaped in this tick to JS as a single array:
+  // this.oncompletion([{ status, opcode, byte_len, qp_num }, ...])
+  // They are dropped if no handler is installed.
+  //
+  void EmitCompletions() {
+    HandleScope scope;
+
+    if (!handle_->Get(String::NewSymbol("oncompletion"))->IsFunction()) {
+      completions_.clear();
+      completions_pending_ = false;
+      return;
+    }
+
+    Local<Array> batch = Array::New(completions_.size());
+
+    for (size_t i = 0; i < completions_.size(); i++) {
+      const RDMACompletion& c = completions_[i];
+
+      Local<Object> rec = Object::New();
+      rec->Set(status_symbol, Integer::New(c.status));
+      rec->Set(opcode_symbol, Integer::New(c.opcode));
+      rec->Set(byte_len_symbol, Integer::NewFromUnsigned(c.byte_len));
+      rec->Set(qp_num_symbol, Integer::NewFromUnsigned(c.qp_num));
+      batch->Set(i, rec);
+    }
+
+    completions_.clear();
+    completions_pending_ = false;
+
+    Local<Value> argv[1] = { batch };
+    node::MakeCallback(handle_, "oncompletion", 1, argv);
+  }
+
+  void EmitConnection(RDMAConnection* conn);
+  void EmitClientConnection(Persistent<Function>* cb, RDMAConnection* conn, int status);
+
+private:
+
+  //
+  // ([srq_depth[, backlog]]) A non-zero srq_depth makes accepted
+  // connections share a receive queue instead of posting receives per
+  // connection. Established connections are passed to
+  // this.onconnection(conn), see RDMAConnectionHandle. Only one server
+  // runs per object until close().
+  //
+  static Handle<Value> Server(const Arguments& args) {
+    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+
+    if (rdma->serverCtx) {
+      return ThrowException(Exception::Error(String::New("Server is already running")));
+    }
+
+    int backlog = RDMA_DEFAULT_BACKLOG;
+    if (args.Length() >= 2) {
+      assert(args[1]->IsInt32());
+      backlog = args[1]->Int32Value();
+    }
+
+    int err;
+    rdma->serverCtx = RDMACreateServerContext(backlog, &err);
+    if (!rdma->serverCtx) {
+      return ThrowException(node::ErrnoException(-err, "server"));
+    }
+    rdma->serverCtx->setConnectionCallback(OnServerConnection, rdma);
+
+    // A running server keeps the object alive until close().
+    rdma->Ref();
+
+    if (args.Length() >= 1) {
+      assert(args[0]->IsUint32());
+      rdma->serverCtx->enableSRQ(args[0]->Uint32Value());
+    }
+
+    return Undefined();
+  }
+
+  static void OnServerConnection(void* arg, RDMAConnection* conn) {
+    ((RDMA*)arg)->EmitConnection(conn);
+  }
+
+  //
+  // Returns { port, connections, accepted, rejected, failed } of the server.
+  //
+  static Handle<Value> ServerStats(const Arguments& args) {
+    HandleScope scope;
+
+    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+    if (!rdma->serverCtx) {
+      return Null();
+    }
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::New("port"), Integer::New(rdma->serverCtx->localPort()));
+    stats->Set(String::New("connections"), Number::New((double)rdma->serverCtx->numConnections()));
+    stats->Set(String::New("accepted"), Number::New((double)rdma->serverCtx->numAccepted()));
+    stats->Set(String::New("rejected"), Number::New((double)rdma->serverCtx->numRejected()));
+    stats->Set(String::New("failed"), Number::New((double)rdma->serverCtx->numFailed()));
+
+    return scope.Close(stats);
+  }
+
+  //
+  // ("addr", port[, cb]) Starts a connection. cb(status, conn) gets the JS
+  // handle of the established connection, or a negative errno and null.
+  // Without cb the connection goes to this.onconnection(conn) like an
+  // accepted one. Every call connects anew; see rdma_pool.js for reuse.
+  //
+  static Handle<Value> Client(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+    assert(args[0]->IsString());
+    assert(args[1]->IsInt32());
+
+    String::AsciiValue ip_address(args[0]->ToString());
+    int port = args[1]->Int32Value();
+
+    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+    if (!rdma->clientCtx) {
+      int err;
+      rdma->clientCtx = RDMACreateClientContext(&err);
+      if (!rdma->clientCtx) {
+        return ThrowException(node::ErrnoException(-err, "client"));
+      }
+      rdma->clientCtx->setConnectCallback(OnClientConnect, rdma);
+
+      // Like a server, until close().
+      rdma->Ref();
+    }
+
+    Persistent<Function>* cb = NULL;
+    if (args.Length() >= 3 && args[2]->IsFunction()) {
+      cb = new Persistent<Function>();
+      *cb = Persistent<Function>::New(Local<Function>::Cast(args[2]));
+    }
+
+    int ret = rdma->clientCtx->connect(*ip_address, port, cb);
+    if (ret) {
+      if (cb) {
+        cb->Dispose();
+        delete cb;
+      }
+      return ThrowException(node::ErrnoException(-ret, "rdma_resolve_addr"));
+    }
+
+    // Pending connects keep the object alive.
+    rdma->Ref();
+
+    return Undefined();
+  }
+
+  static void OnClientConnect(void* arg, void* req, RDMAConnection* conn, int status) {
+    RDMA* rdma = (RDMA*)arg;
+
+    rdma->EmitClientConnection((Persistent<Function>*)req, conn, status);
+    rdma->Unref();
+  }
+
+  //
+  // Stops the server and destroys every connection of both sides. Pending
+  // connects fail with -ECANCELED. server() and client() may be called
+  // again afterwards.
+  //
+  static Handle<Value> Close(const Arguments& args) {
+    HandleScope scope;
+
+    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+
+    // Detached first: cancelled connect callbacks may call client() again.
+    if (rdma->serverCtx) {
+      RDMAServerContext* sctx = rdma->serverCtx;
+      rdma->serverCtx = NULL;
+      sctx->close();
+      rdma->Unref();
+    }
+
+    if (rdma->clientCtx) {
+      RDMAClientContext* cctx = rdma->clientCtx;
+      rdma->clientCtx = NULL;
+      cctx->close();
+      rdma->Unref();
+    }
+
+    return Undefined();
+  }
+
+  //
+  // Returns { connections, pending, established, failed } of the client
+  // side, or null before the first client() call.
+  //
+  static Handle<Value> ClientStats(const Arguments& args) {
+    HandleScope scope;
+
+    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+    if (!rdma->clientCtx) {
+      return Null();
+    }
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::New("connections"), Number::New((double)rdma->clientCtx->numConnections()));
+    stats->Set(String::New("pending"), Number::New((double)rdma->clientCtx->numPending()));
+    stats->Set(String::New("established"), Number::New((double)rdma->clientCtx->numEstablished()));
+    stats->Set(String::New("failed"), Number::New((double)rdma->clientCtx->numFailed()));
+
+    return scope.Close(stats);
+  }
+
+  //
+  // (max_send_wr, max_recv_wr) Sets the QP capabilities of connections
+  // created afterwards. A receive queue must hold RDMA_RECV_DEPTH receives
+  // and a send queue RDMA_MIN_SEND_WR requests; either is capped at what
+  // the device supports when the QP is created.
+  //
+  static Handle<Value> SetQPCaps(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+    assert(args[0]->IsUint32());
+    assert(args[1]->IsUint32());
+
+    uint32_t max_send_wr = args[0]->Uint32Value();
+    uint32_t max_recv_wr = args[1]->Uint32Value();
+
+    if (max_send_wr < RDMA_MIN_SEND_WR) {
+      return ThrowException(Exception::RangeError(
+          String::New("max_send_wr is below the minimum of 4")));
+    }
+    if (max_recv_wr < RDMA_RECV_DEPTH) {
+      return ThrowException(Exception::RangeError(
+          String::New("max_recv_wr is below the minimum of 8")));
+    }
+
+    g_qp_config.max_send_wr = max_send_wr;
+    g_qp_config.max_recv_wr = max_recv_wr;
+
+    return Undefined();
+  }
+
+  //
+  // Signal every n-th send on connections (n >= 1). 1 signals every send.
+  //
+  static Handle<Value> SetSignalInterval(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsUint32());
+
+    uint32_t n = args[0]->Uint32Value();
+    g_qp_config.signal_interval = n > 0 ? n : 1;
+
+    return Undefined();
+  }
+
+  //
+  // Configures the CQs of device contexts created afterwards.
+  // (num_cqs[, { workers: bool, cpus: [cpu, ...], assign: "least_loaded" | "hash" }])
+  //
+  static Handle<Value> SetCQs(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsInt32());
+
+    int n = args[0]->Int32Value();
+    if (n < 1) n = 1;
+    if (n > RDMA_MAX_CQS) n = RDMA_MAX_CQS;
+
+    g_cq_config.num_cqs = n;
+
+    if (args.Length() >= 2) {
+      assert(args[1]->IsObject());
+      Local<Object> opts = args[1]->ToObject();
+
+      Local<Value> workers = opts->Get(String::New("workers"));
+      if (!workers->IsUndefined()) {
+        g_cq_config.workers = workers->BooleanValue();
+      }
+
+      Local<Value> cpus = opts->Get(String::New("cpus"));
+      if (cpus->IsArray()) {
+        Local<Array> list = Local<Array>::Cast(cpus);
+
+        if (!g_cq_config.cpus) {
+          g_cq_config.cpus = new std::vector<int>();
+        }
+        g_cq_config.cpus->clear();
+
+        for (uint32_t i = 0; i < list->Length(); i++) {
+          g_cq_config.cpus->push_back(list->Get(i)->Int32Value());
+        }
+      }
+
+      Local<Value> assign = opts->Get(String::New("assign"));
+      if (assign->IsString()) {
+        String::AsciiValue name(assign);
+        if (strcmp(*name, "hash") == 0) {
+          g_cq_config.assign = RDMACQConfig::ASSIGN_HASH;
+        } else if (strcmp(*name, "least_loaded") == 0) {
+          g_cq_config.assign = RDMACQConfig::ASSIGN_LEAST_LOADED;
+        } else {
+          return ThrowException(Exception::Error(String::New("Unknown CQ assignment")));
+        }
+      }
+    }
+
+    return Undefined();
+  }
+
+  //
+  // Returns buffer pool statistics summed over every protection domain.
+  // { hits, misses, pinned_bytes, leased_bytes }
+  //
+  static Handle<Value> PoolStats(const Arguments& args) {
+    HandleScope scope;
+
+    RDMAPoolStats total;
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; i < g_pools.size(); i++) {
+      total.hits          += g_pools[i]->stats.hits;
+      total.misses        += g_pools[i]->stats.misses;
+      total.pinned_bytes  += g_pools[i]->stats.pinned_bytes;
+      total.leased_bytes  += g_pools[i]->stats.leased_bytes;
+    }
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::New("hits"), Number::New((double)total.hits));
+    stats->Set(String::New("misses"), Number::New((double)total.misses));
+    stats->Set(String::New("pinned_bytes"), Number::New((double)total.pinned_bytes));
+    stats->Set(String::New("leased_bytes"), Number::New((double)total.leased_bytes));
+
+    return scope.Close(stats);
+  }
+
+  //
+  // Sets the number of work completions reaped per ibv_poll_cq() call.
+  // (wc_batch), clamped to [1, 128].
+  //
+  static Handle<Value> SetPollBatch(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsInt32());
+
+    int batch = args[0]->Int32Value();
+    if (batch < 1) batch = 1;
+    if (batch > RDMA_MAX_WC_BATCH) batch = RDMA_MAX_WC_BATCH;
+
+    g_poll_config.wc_batch = batch;
+
+    return Undefined();
+  }
+
+  //
+  // Configures hybrid completion polling for contexts created afterwards.
+  // (max_budget_us[, min_budget_us]). max_budget_us = 0 selects pure
+  // interrupt-driven completion.
+  //
+  static Handle<Value> SetPollBudget(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsUint32());
+
+    g_poll_config.max_budget_ns = (uint64_t)args[0]->Uint32Value() * 1000;
+
+    if (args.Length() >= 2) {
+      assert(args[1]->IsUint32());
+      g_poll_config.min_budget_ns = (uint64_t)args[1]->Uint32Value() * 1000;
+    }
+
+    if (g_poll_config.min_budget_ns > g_poll_config.max_budget_ns) {
+      g_poll_config.min_budget_ns = g_poll_config.max_budget_ns;
+    }
+
+    return Undefined();
+  }
+
+  static Handle<Value>  New(const Arguments& args) {
+
+    HandleScope scope;
+    if (!args.IsConstructCall()) {
+      return args.Callee()->NewInstance();
+    }
+
+    try {
+      (new RDMA())->Wrap(args.This());
+    } catch (const char* msg) {
+      return ThrowException(Exception::Error(String::New(msg)));
+    }
+
+    return args.This();
+  }
+
+  RDMA() : serverCtx(NULL), clientCtx(NULL), completions_pending_(false) {
+    val = 3;
+  }
+
+  ~RDMA() {
+    // Both contexts hold a reference until close().
+    assert(!serverCtx);
+    assert(!clientCtx);
+  }
+
+
+};
+
+//
+// JS handle of an established RDMAConnection, the native side of
+// RDMAStream (rdma_stream.js). Payloads arrive as this.ondata(buffer),
+// this.ondrain() follows a write() which returned false, this.onend()
+// reports the peer's shutdown() and this.onclose() the connection going
+// away.
+//
+class RDMAConnectionHandle : public node::ObjectWrap {
+public:
+
+  static void Initialize(Handle<Object> target) {
+
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    t->SetClassName(String::NewSymbol("RDMAConnection"));
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "write", Write);
+    NODE_SET_PROTOTYPE_METHOD(t, "shutdown", Shutdown);
+    NODE_SET_PROTOTYPE_METHOD(t, "pause", Pause);
+    NODE_SET_PROTOTYPE_METHOD(t, "resume", Resume);
+    NODE_SET_PROTOTYPE_METHOD(t, "disconnect", Disconnect);
+    NODE_SET_PROTOTYPE_METHOD(t, "expose", Expose);
+    NODE_SET_PROTOTYPE_METHOD(t, "read_remote", ReadRemote);
+    NODE_SET_PROTOTYPE_METHOD(t, "write_remote", WriteRemote);
+    NODE_SET_PROTOTYPE_METHOD(t, "fetch_add", FetchAdd);
+    NODE_SET_PROTOTYPE_METHOD(t, "cmp_swap", CmpSwap);
+    NODE_SET_PROTOTYPE_METHOD(t, "alloc_mw", AllocMW);
+    NODE_SET_PROTOTYPE_METHOD(t, "bind_mw", BindMW);
+    NODE_SET_PROTOTYPE_METHOD(t, "invalidate_mw", InvalidateMW);
+    NODE_SET_PROTOTYPE_METHOD(t, "dealloc_mw", DeallocMW);
+
+    constructor = Persistent<Function>::New(t->GetFunction());
+
+    mw_template = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+    mw_template->SetInternalFieldCount(1);
+
+    target->Set(String::NewSymbol("RDMAConnection"), constructor);
+
+  }
+
+  //
+  // Creates the JS handle of a connection and installs its handlers. The
+  // handle stays alive until the connection is destroyed.
+  //
+  static Local<Object> NewHandle(RDMAConnection* conn) {
+    HandleScope scope;
+
+    Local<Object> obj = constructor->NewInstance();
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(obj);
+
+    h->conn_ = conn;
+    h->Ref();
+
+    conn->data                = h;
+    conn->recv_handler        = OnRecv;
+    conn->send_done_handler   = OnSendDone;
+    conn->rndv_target_handler = OnRndvTarget;
+    conn->drain_handler       = OnDrain;
+    conn->end_handler         = OnEnd;
+    conn->close_handler       = OnClose;
+    conn->expose_handler      = OnExpose;
+    conn->op_done_handler     = OnOpDone;
+
+    return scope.Close(obj);
+  }
+
+private:
+
+  static Persistent<Function> constructor;
+  static Persistent<ObjectTemplate> mw_template;    ///< Internal field 0 holds the RDMAMW*
+
+  //
+  // (buffer) -> true if the data went out, false if it has to wait for
+  // credits, ring space or send queue slots; ondrain() follows then.
+  //
+  // Payloads above RDMA_RNDV_THRESHOLD are staged in a pooled buffer and
+  // read by the peer, smaller ones are copied into its write ring.
+  //
+  static Handle<Value> Write(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(node::Buffer::HasInstance(args[0]));
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (!h->conn_) {
+      return ThrowException(Exception::Error(String::New("Connection is closed")));
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    const char* data = node::Buffer::Data(buffer);
+    size_t len = node::Buffer::Length(buffer);
+
+    const size_t max_chunk = (size_t)1 << RDMA_POOL_MAX_SHIFT;
+
+    for (size_t off = 0; off < len; ) {
+      uint32_t n = (uint32_t)std::min(len - off, max_chunk);
+
+      if (n <= RDMA_RNDV_THRESHOLD) {
+        RDMARingSend(h->conn_, data + off, n);
+      } else {
+        RDMABuffer* buf = RDMAPoolGet(h->conn_->ctx->pool, n);
+        memcpy(buf->addr, data + off, n);
+        h->staged_.insert(buf);
+        RDMASendRegion(h->conn_, (const char*)buf->addr, n, buf->mr, (uintptr_t)buf);
+      }
+
+      off += n;
+    }
+
+    return scope.Close(Boolean::New(!RDMATxBlocked(h->conn_)));
+  }
+
+  //
+  // Tells the peer no more data follows; it sees onend().
+  //
+  static Handle<Value> Shutdown(const Arguments& args) {
+    HandleScope scope;
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (!h->conn_) {
+      return Undefined();
+    }
+
+    RDMAMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = RDMAMessage::MSG_DONE;
+    RDMAPostMessage(h->conn_, &msg);
+
+    return Undefined();
+  }
+
+  //
+  // Stops returning credits to the peer, so its writes back up.
+  //
+  static Handle<Value> Pause(const Arguments& args) {
+    HandleScope scope;
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (h->conn_) {
+      RDMASetPaused(h->conn_, true);
+    }
+
+    return Undefined();
+  }
+
+  static Handle<Value> Resume(const Arguments& args) {
+    HandleScope scope;
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (h->conn_) {
+      RDMASetPaused(h->conn_, false);
+    }
+
+    return Undefined();
+  }
+
+  //
+  // Tears the connection down; onclose() follows once the CM reports it.
+  //
+  static Handle<Value> Disconnect(const Arguments& args) {
+    HandleScope scope;
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (h->conn_) {
+      rdma_disconnect(h->conn_->id);
+    }
+
+    return Undefined();
+  }
+
+  //
+  // (length[, grant]) -> Buffer
+  //
+  // Exposes `length` bytes of registered memory to the peer, which sees
+  // onexpose(length) and may then read_remote()/write_remote() it without
+  // involving us. The returned Buffer is that memory. Once per connection.
+  //
+  // With `grant` false the peer is not told about the memory; it only gets
+  // access to the parts a memory window is bound to, see bind_mw().
+  //
+  static Handle<Value> Expose(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsUint32());
+
+    bool grant = args.Length() < 2 || args[1]->IsUndefined() || args[1]->BooleanValue();
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (!h->conn_ || !h->conn_->connected) {
+      return ThrowException(Exception::Error(String::New("Connection is closed")));
+    }
+
+    if (h->conn_->expose_buf) {
+      return ThrowException(Exception::Error(String::New("Memory is already exposed")));
+    }
+
+    uint32_t len = args[0]->Uint32Value();
+    if (len == 0 || len > ((size_t)1 << RDMA_POOL_MAX_SHIFT)) {
+      return ThrowException(Exception::RangeError(String::New("Invalid length")));
+    }
+
+    RDMABuffer* buf = RDMAPoolGet(h->conn_->ctx->pool, len);
+    memset(buf->addr, 0, len);
+
+    // As for received payloads the Buffer pins the context. The handle
+    // keeps it alive while the peer may still access the memory.
+    Lease* lease = new Lease;
+    lease->buf = buf;
+    lease->ctx = h->conn_->ctx;
+    lease->ctx->refs++;
+
+    node::Buffer* buffer = node::Buffer::New((char*)buf->addr, len, FreeLease, lease);
+    h->exposed_ = Persistent<Object>::New(buffer->handle_);
+
+    RDMAExpose(h->conn_, buf, len, grant);
+
+    return scope.Close(buffer->handle_);
+  }
+
+  //
+  // (offset, length[, callback])
+  //
+  // RDMA-READs `length` bytes at `offset` of the memory the peer exposed.
+  // callback(status, buffer) runs with an enum ibv_wc_status and the data.
+  //
+  static Handle<Value> ReadRemote(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+    assert(args[0]->IsUint32());
+    assert(args[1]->IsUint32());
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+
+    uint32_t offset = args[0]->Uint32Value();
+    uint32_t len = args[1]->Uint32Value();
+
+    RDMAOp* op = h->NewOp(IBV_WR_RDMA_READ, offset, len, args[2]);
+    if (!op) {
+      return Undefined();
+    }
+
+    RDMAPostOp(h->conn_, op);
+
+    return Undefined();
+  }
+
+  //
+  // (buffer, offset[, callback])
+  //
+  // RDMA-WRITEs the Buffer at `offset` of the memory the peer exposed.
+  // callback(status) runs once the data has landed.
+  //
+  static Handle<Value> WriteRemote(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+    assert(node::Buffer::HasInstance(args[0]));
+    assert(args[1]->IsUint32());
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
 
-    ibv_dereg_mr(conn->send_mr);
-    ibv_dereg_mr(conn->recv_mr);
-    ibv_dereg_mr(conn->rdma_local_mr);
-    ibv_dereg_mr(conn->rdma_remote_mr);
+    Local<Object> buffer = args[0]->ToObject();
+    uint32_t offset = args[1]->Uint32Value();
+    uint32_t len = node::Buffer::Length(buffer);
 
-    free(conn->send_msg);
-    free(conn->recv_msg);
-    free(conn->rdma_local_region);
-    free(conn->rdma_remote_region);
+    RDMAOp* op = h->NewOp(IBV_WR_RDMA_WRITE, offset, len, args[2]);
+    if (!op) {
+      return Undefined();
+    }
 
-    rdma_destroy_id(conn->id);
+    memcpy(op->buf->addr, node::Buffer::Data(buffer), len);
+    RDMAPostOp(h->conn_, op);
 
-    free(conn);
+    return Undefined();
+  }
 
-}
+  //
+  // (offset, add[, callback])
+  //
+  // Atomically adds `add` to the 64-bit word at `offset` (8-byte aligned)
+  // of the memory the peer exposed. callback(status, previous) gets the
+  // previous value as an 8-byte Buffer in host byte order. See GetU64()
+  // for the operand.
+  //
+  static Handle<Value> FetchAdd(const Arguments& args) {
+    return PostAtomic(args, IBV_WR_ATOMIC_FETCH_AND_ADD, 1);
+  }
 
-static void RDMASendMessage(RDMAConnection* conn)
-{
-    struct ibv_send_wr wr;
-    struct ibv_send_wr *bad_wr = NULL;
-    struct ibv_sge sge;
+  //
+  // (offset, compare, swap[, callback])
+  //
+  // Atomically replaces the 64-bit word at `offset` with `swap` if it
+  // equals `compare`. The previous value is passed as for fetch_add(); the
+  // swap took place if it equals `compare`.
+  //
+  static Handle<Value> CmpSwap(const Arguments& args) {
+    return PostAtomic(args, IBV_WR_ATOMIC_CMP_AND_SWP, 2);
+  }
 
-    memset(&wr, 0, sizeof(wr));
+  static Handle<Value> PostAtomic(const Arguments& args, enum ibv_wr_opcode opcode,
+                                  int noperands) {
+    HandleScope scope;
 
-    wr.wr_id = (uintptr_t)conn;
-    wr.opcode = IBV_WR_SEND;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    assert(args.Length() >= 1 + noperands);
+    assert(args[0]->IsUint32());
 
-    sge.addr = (uintptr_t)conn->send_msg;
-    sge.length = sizeof(RDMAMessage);
-    sge.lkey = conn->send_mr->lkey;
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
 
-    // @fixme { Is this required? }
-    while (!conn->connected);
+    uint64_t operands[2] = { 0, 0 };
+    for (int i = 0; i < noperands; i++) {
+      if (!GetU64(args[1 + i], &operands[i])) {
+        return ThrowException(Exception::TypeError(
+            String::New("64-bit operand must be an 8-byte Buffer, [hi, lo] or a uint32")));
+      }
+    }
 
-    int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
-    assert(!ret);
+    uint32_t offset = args[0]->Uint32Value();
+    if (offset % 8) {
+      return ThrowException(Exception::RangeError(
+          String::New("Atomic operations need an 8-byte aligned offset")));
+    }
 
-}
+    if (h->conn_ && !h->conn_->ctx->atomics) {
+      return ThrowException(Exception::Error(
+          String::New("Device does not support atomic operations")));
+    }
 
-static void RDMASendMR(void *context)
-{
-    RDMAConnection* conn = (RDMAConnection*)context;
+    RDMAOp* op = h->NewOp(opcode, offset, 8, args[1 + noperands]);
+    if (!op) {
+      return Undefined();
+    }
 
-    conn->send_msg->type = RDMAMessage::MSG_MR;
-    memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
+    op->compare_add = operands[0];
+    op->swap        = operands[1];
 
-    RDMASendMessage(conn);
-}
+    RDMAPostOp(h->conn_, op);
 
+    return Undefined();
+  }
 
-static void OnConnect(void* context)
-{
-    ((RDMAConnection*)context)->connected = 1;
-}
+  //
+  // ([type]) -> mw
+  //
+  // Allocates a memory window of type 1 (default) or 2 on the connection's
+  // PD. Windows grant the peer access to part of the memory set aside with
+  // expose(), and are moved and revoked with work requests on the QP
+  // rather than by registering memory. See bind_mw().
+  //
+  static Handle<Value> AllocMW(const Arguments& args) {
+    HandleScope scope;
 
-static void OnCompletion(struct ibv_wc* wc)
-{
-    RDMAConnection* conn = (RDMAConnection*)(uintptr_t)wc->wr_id;
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+    if (!h->conn_ || !h->conn_->connected) {
+      return ThrowException(Exception::Error(String::New("Connection is closed")));
+    }
 
-    if (wc->status != IBV_WC_SUCCESS) {
-        // die(expects IBV_WC_SUCCESS)
-        exit(-1);
+    enum ibv_mw_type type = IBV_MW_TYPE_1;
+    if (args.Length() >= 1 && !args[0]->IsUndefined()) {
+      assert(args[0]->IsInt32());
+      if (args[0]->Int32Value() == 2) {
+        type = IBV_MW_TYPE_2;
+      } else if (args[0]->Int32Value() != 1) {
+        return ThrowException(Exception::RangeError(
+            String::New("Memory window type must be 1 or 2")));
+      }
     }
 
-    if (wc->opcode & IBV_WC_RECV) {
-        conn->recv_state = RDMAConnection::NextRecvState(conn->recv_state);
+    RDMAContext* ctx = h->conn_->ctx;
+    if (!(type == IBV_MW_TYPE_1 ? ctx->mw_type1 : ctx->mw_type2)) {
+      return ThrowException(Exception::Error(
+          String::New("Device does not support this type of memory window")));
+    }
 
-        if (conn->recv_msg->type == RDMAMessage::MSG_MR) {
-            memcpy(&conn->peer_mr, &conn->recv_msg->data.mr, sizeof(conn->peer_mr));
-            RDMAPostReceives(conn);
+    struct ibv_mw* mw = ibv_alloc_mw(ctx->pd, type);
+    if (!mw) {
+      return ThrowException(node::ErrnoException(errno, "ibv_alloc_mw"));
+    }
 
-            if (conn->send_state == RDMAConnection::SS_INIT) {
-                RDMASendMR(conn);
-            }
-        }
-    } else {
-        conn->send_state = RDMAConnection::NextSendState(conn->send_state);
+    RDMAMW* m = new RDMAMW;
+    m->mw       = mw;
+    m->rkey     = mw->rkey;
+    m->bound    = false;
+    m->pending  = 0;
+
+    Local<Object> obj = mw_template->NewInstance();
+    obj->SetPointerInInternalField(0, m);
+    obj->Set(String::New("type"), Integer::New(type == IBV_MW_TYPE_2 ? 2 : 1));
+
+    h->windows_[m] = Persistent<Object>::New(obj);
+
+    return scope.Close(obj);
+  }
+
+  //
+  // (mw, offset, length, access[, callback])
+  //
+  // Binds the window to [offset, offset + length) of the exposed memory
+  // with remote `access` (IBV_ACCESS_REMOTE_READ/WRITE/ATOMIC) and points
+  // the peer's one-sided operations at it: it sees onexpose(length), and
+  // offsets are relative to the window from then on. A bound type 1
+  // window is moved in place and the previous rkey stops working; type 2
+  // windows are invalidated first. callback(status, rkey) runs once the
+  // bind took effect.
+  //
+  static Handle<Value> BindMW(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 4);
+    assert(args[1]->IsUint32());
+    assert(args[2]->IsUint32());
+    assert(args[3]->IsInt32());
+
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
+
+    RDMAMW* m = h->GetMW(args[0]);
+    if (!m) {
+      return Undefined();
     }
-}
 
-static void* PollCQ(RDMAContext* s_ctx, void* ctx)
-{
-    struct ibv_cq* cq;
-    struct ibv_wc  wc;
+    if (m->bound && m->mw->type == IBV_MW_TYPE_2) {
+      return ThrowException(Exception::Error(
+          String::New("Type 2 memory windows must be invalidated before rebinding")));
+    }
 
-    while (1) {
-        int ret = ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx);
-        assert(!ret);
-        ibv_ack_cq_events(cq, 1);
-        ret = ibv_req_notify_cq(cq, 0);
-        assert(!ret);
+    if (h->exposed_.IsEmpty()) {
+      return ThrowException(Exception::Error(
+          String::New("Memory windows are bound to exposed memory, see expose()")));
+    }
 
-        while (ibv_poll_cq(cq, 1, &wc)) {
-            OnCompletion(&wc);
-        }
+    uint32_t offset = args[1]->Uint32Value();
+    uint32_t len = args[2]->Uint32Value();
+    size_t exposed = node::Buffer::Length(h->exposed_);
+
+    if (len == 0 || offset > exposed || len > exposed - offset) {
+      return ThrowException(Exception::RangeError(
+          String::New("Range is not covered by the exposed memory")));
     }
 
-    return NULL;
-}
+    RDMAOp* op = h->NewMWOp(IBV_WR_BIND_MW, m, args[4]);
+    op->length      = len;
+    op->bind_addr   = (uintptr_t)node::Buffer::Data(h->exposed_) + offset;
+    op->bind_access = args[3]->Int32Value();
 
-class
-RDMAClientContext
-{
-public:
+    m->bound = true;
+    RDMAPostOp(h->conn_, op);
 
-  void init(const char* ipaddr, int port) {
+    return Undefined();
+  }
 
-    struct addrinfo* addr;
+  //
+  // (mw[, callback])
+  //
+  // Revokes the window's grant and tells the peer, which sees
+  // onexpose(0). Peer accesses ordered after it on the QP fail with a
+  // remote access error. callback(status) runs once it took effect.
+  //
+  static Handle<Value> InvalidateMW(const Arguments& args) {
+    HandleScope scope;
 
-    char buf[1024];
-    sprintf(buf, "%d", port);
+    assert(args.Length() >= 1);
 
-    int ret;
-    ret = getaddrinfo(ipaddr, buf, NULL, &addr);
-    assert(ret == 0);
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
 
-    ret = rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP);
-    assert(!ret);
+    RDMAMW* m = h->GetMW(args[0]);
+    if (!m || !m->bound) {
+      return Undefined();
+    }
 
-    int TIMEOUT_IN_MS = 500; // Arbitraray
-    ret = rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS);
-    assert(!ret);
+    RDMAOp* op = h->NewMWOp(IBV_WR_LOCAL_INV, m, args[1]);
 
-    freeaddrinfo(addr);
+    m->bound = false;
+    RDMAPostOp(h->conn_, op);
 
+    return Undefined();
   }
 
-  RDMAClientContext(const char* ipaddr, int port) {
-    init(ipaddr, port);
-  }
+  //
+  // (mw) Frees the window, which revokes any grant it still carries.
+  // Windows left over are freed when the connection closes.
+  //
+  static Handle<Value> DeallocMW(const Arguments& args) {
+    HandleScope scope;
 
-  ~RDMAClientContext() {
-    rdma_destroy_event_channel(ec);
-  }
+    assert(args.Length() >= 1);
 
+    RDMAConnectionHandle* h = ObjectWrap::Unwrap<RDMAConnectionHandle>(args.This());
 
-private:
+    RDMAMW* m;
+    if (!h->LookupMW(args[0], &m) || !m) {
+      return Undefined();
+    }
 
-  struct rdma_event_channel*  ec;
-  struct rdma_cm_id*          conn;
-  int                         port;
-   
+    if (m->pending > 0) {
+      return ThrowException(Exception::Error(
+          String::New("Memory window has a bind or invalidation in flight")));
+    }
 
-};
+    int ret = h->FreeMW(m);
+    if (ret) {
+      return ThrowException(node::ErrnoException(ret, "ibv_dealloc_mw"));
+    }
 
-class
-RDMAServerContext
-{
-public:
+    return Undefined();
+  }
 
-  void init() {
+  //
+  // Sets *m to the window behind `value`, or to NULL once it has been
+  // deallocated. Returns false with a TypeError scheduled if `value` is not
+  // a window of this connection. The pointer read from the internal field
+  // is not dereferenced unless windows_ maps it to this very object.
+  //
+  bool LookupMW(Handle<Value> value, RDMAMW** m) {
+    if (!value->IsObject() || value->ToObject()->InternalFieldCount() != 1) {
+      ThrowException(Exception::TypeError(String::New("Not a memory window")));
+      return false;
+    }
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
+    Local<Object> obj = value->ToObject();
 
-    ec = rdma_create_event_channel();
-    assert(ec);
+    *m = (RDMAMW*)obj->GetPointerFromInternalField(0);
+    if (!*m) {
+      return true;
+    }
 
-    int ret;
-    ret = rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP);
-    assert(!ret);
+    std::map<RDMAMW*, Persistent<Object> >::iterator it = windows_.find(*m);
+    if (it == windows_.end() || !it->second->StrictEquals(obj)) {
+      ThrowException(Exception::TypeError(
+          String::New("Not a memory window of this connection")));
+      return false;
+    }
 
-    ret = rdma_bind_addr(listener, (struct sockaddr *)&addr);
-    assert(!ret);
+    return true;
+  }
 
-    ret = rdma_listen(listener, 10); // 10 = backlog, arbitrary
-    assert(!ret);
+  //
+  // Looks up a window of this connection. Returns NULL with a JS exception
+  // scheduled if it cannot be used.
+  //
+  RDMAMW* GetMW(Handle<Value> value) {
+    if (!conn_ || !conn_->connected) {
+      ThrowException(Exception::Error(String::New("Connection is closed")));
+      return NULL;
+    }
 
-    port = ntohs(rdma_get_src_port(listener));
+    RDMAMW* m;
+    if (!LookupMW(value, &m)) {
+      return NULL;
+    }
 
-    std::cout << "Server: port " << port << std::endl;
+    if (!m) {
+      ThrowException(Exception::Error(String::New("Memory window was deallocated")));
+      return NULL;
+    }
 
+    return m;
   }
 
-  RDMAServerContext() : ec(NULL), listener(NULL), port(0) {
-    init();
-  }
+  RDMAOp* NewMWOp(enum ibv_wr_opcode opcode, RDMAMW* m, Handle<Value> callback) {
+    RDMAOp* op = new RDMAOp;
+    memset(op, 0, sizeof(*op));
+    op->opcode  = opcode;
+    op->mw      = m;
+
+    if (callback->IsFunction()) {
+      op->data = new Persistent<Function>(
+          Persistent<Function>::New(Local<Function>::Cast(callback)));
+    }
+
+    m->pending++;
 
-  ~RDMAServerContext() {
-    rdma_destroy_id(listener);
-    rdma_destroy_event_channel(ec);
+    return op;
   }
 
+  //
+  // Deallocates a window and detaches it from its JS object. Returns 0 or
+  // an errno.
+  //
+  int FreeMW(RDMAMW* m) {
+    int ret = ibv_dealloc_mw(m->mw);
+    if (ret) {
+      return ret;
+    }
 
-private:
+    Persistent<Object>& obj = windows_[m];
+    obj->SetPointerInInternalField(0, NULL);
+    obj.Dispose();
 
-  struct rdma_event_channel*  ec;
-  struct rdma_cm_id*          listener;
-  int                         port;
-  
-};
+    windows_.erase(m);
+    delete m;
 
-static RDMAServerContext* RDMACreateServerContext()
-{
-  return new RDMAServerContext();
-}
+    return 0;
+  }
 
+  //
+  // Reads a 64-bit atomic operand: an 8-byte Buffer in host byte order,
+  // [hi, lo] as two uint32 or a uint32. A JS number is a double, so larger
+  // values do not pass through one exactly.
+  //
+  static bool GetU64(Handle<Value> value, uint64_t* out) {
+    if (node::Buffer::HasInstance(value)) {
+      Local<Object> buffer = value->ToObject();
+      if (node::Buffer::Length(buffer) != 8) {
+        return false;
+      }
+      memcpy(out, node::Buffer::Data(buffer), 8);
+      return true;
+    }
 
-class EioData
-{
-public:
-    EioData();
-    ~EioData();
-};
+    if (value->IsArray()) {
+      Local<Array> halves = Local<Array>::Cast(value);
+      if (halves->Length() != 2 ||
+          !halves->Get(0)->IsUint32() || !halves->Get(1)->IsUint32()) {
+        return false;
+      }
+      *out = ((uint64_t)halves->Get(0)->Uint32Value() << 32) |
+             halves->Get(1)->Uint32Value();
+      return true;
+    }
 
+    if (value->IsUint32()) {
+      *out = value->Uint32Value();
+      return true;
+    }
 
-Persistent<Function> rdmaConstructor;
+    return false;
+  }
 
-static Persistent<String> family_symbol;
-static Persistent<String> address_symbol;
-static Persistent<String> port_symbol;
+  //
+  // Checks the range against the peer's exposed memory and sets up an op
+  // with a pool buffer of `len` bytes. Returns NULL with a JS exception
+  // scheduled if the op cannot be issued.
+  //
+  RDMAOp* NewOp(enum ibv_wr_opcode opcode, uint32_t offset, uint32_t len,
+                Handle<Value> callback) {
+    if (!conn_ || !conn_->connected) {
+      ThrowException(Exception::Error(String::New("Connection is closed")));
+      return NULL;
+    }
 
-class RDMA : public node::ObjectWrap {
-public:
+    if (conn_->peer_expose_length == 0) {
+      ThrowException(Exception::Error(String::New("The peer has not exposed memory")));
+      return NULL;
+    }
 
-  static void Initialize(Handle<Object> target) {
+    if (len == 0 || len > ((size_t)1 << RDMA_POOL_MAX_SHIFT) ||
+        offset > conn_->peer_expose_length || len > conn_->peer_expose_length - offset) {
+      ThrowException(Exception::RangeError(
+          String::New("Range is not covered by the exposed memory")));
+      return NULL;
+    }
+
+    RDMAOp* op = new RDMAOp;
+    op->opcode      = opcode;
+    op->buf         = RDMAPoolGet(conn_->ctx->pool, len);
+    op->length      = len;
+    op->remote_addr = conn_->peer_expose_addr + offset;
+    op->rkey        = conn_->peer_expose_rkey;
+    op->mw          = NULL;
+    op->data        = NULL;
+
+    if (callback->IsFunction()) {
+      op->data = new Persistent<Function>(
+          Persistent<Function>::New(Local<Function>::Cast(callback)));
+    }
+
+    return op;
+  }
 
+  static Handle<Value> New(const Arguments& args) {
     HandleScope scope;
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
-    t->SetClassName(String::NewSymbol("RDMA"));
+    (new RDMAConnectionHandle())->Wrap(args.This());
 
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+    return args.This();
+  }
 
+  RDMAConnectionHandle() : conn_(NULL) { }
 
+  ~RDMAConnectionHandle() { }
 
-    // API
-    NODE_SET_PROTOTYPE_METHOD(t, "server", Server);
-    NODE_SET_PROTOTYPE_METHOD(t, "client", Client);
+  void Emit(const char* name, int argc, Handle<Value> argv[]) {
+    HandleScope scope;
 
+    Local<Value> cb = handle_->Get(String::NewSymbol(name));
+    if (!cb->IsFunction()) {
+      return;
+    }
 
-    rdmaConstructor = Persistent<Function>::New(t->GetFunction());
+    node::MakeCallback(handle_, name, argc, argv);
+  }
 
-    family_symbol = NODE_PSYMBOL("family");
-    address_symbol = NODE_PSYMBOL("address");
-    port_symbol = NODE_PSYMBOL("port");
+  //
+  // Ring records are only valid during the call and get copied. Rendezvous
+  // payloads were read into a pool buffer by OnRndvTarget(); that buffer is
+  // handed to JS as is and goes back to the pool when the Buffer is
+  // collected.
+  //
+  static void OnRecv(RDMAConnection* conn, const char* data, uint32_t len) {
+    HandleScope scope;
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
+    node::Buffer* buffer;
+
+    std::map<const char*, RDMABuffer*>::iterator it = h->leases_.find(data);
+    if (it != h->leases_.end()) {
+      // The Buffer may outlive the connection; it pins the context, whose
+      // pool owns the memory.
+      Lease* lease = new Lease;
+      lease->buf = it->second;
+      lease->ctx = conn->ctx;
+      lease->ctx->refs++;
+
+      buffer = node::Buffer::New((char*)data, len, FreeLease, lease);
+      h->leases_.erase(it);
+    } else {
+      buffer = node::Buffer::New(len);
+      memcpy(node::Buffer::Data(buffer), data, len);
+    }
 
-    target->Set(String::NewSymbol("RDMA"), rdmaConstructor);
+    Local<Value> argv[1] = { Local<Object>::New(buffer->handle_) };
+    h->Emit("ondata", 1, argv);
+  }
+
+  static bool OnRndvTarget(RDMAConnection* conn, uint32_t len, char** addr, uint32_t* lkey) {
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
+
+    if (len > ((size_t)1 << RDMA_POOL_MAX_SHIFT)) {
+      return false;
+    }
 
+    RDMABuffer* buf = RDMAPoolGet(conn->ctx->pool, len);
+    *addr = (char*)buf->addr;
+    *lkey = buf->mr->lkey;
+
+    h->leases_[*addr] = buf;
+
+    return true;
   }
 
-  int val;
-  RDMAContext ctx;
-  RDMAServerContext* serverCtx;
-  RDMAClientContext* clientCtx;
+  struct Lease {
+    RDMABuffer*   buf;
+    RDMAContext*  ctx;
+  };
 
-private:
+  static void FreeLease(char* data, void* hint) {
+    Lease* lease = (Lease*)hint;
 
-  static Handle<Value> Server(const Arguments& args) {
-    std::cout << "Server" << std::endl;
+    RDMAPoolPut(lease->buf);
+    RDMAReleaseContext(lease->ctx);
 
-    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+    delete lease;
+  }
 
-    rdma->serverCtx = new RDMAServerContext();
-    
+  // Write() staged the payload in a lease; the peer is done reading it.
+  static void OnSendDone(RDMAConnection* conn, uint64_t cookie, int status) {
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
+    RDMABuffer* buf = (RDMABuffer*)(uintptr_t)cookie;
+
+    if (buf && h->staged_.erase(buf)) {
+      RDMAPoolPut(buf);
+    }
   }
 
-  static Handle<Value> Client(const Arguments& args) {
+  static void OnDrain(RDMAConnection* conn) {
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
+    h->Emit("ondrain", 0, NULL);
+  }
 
-    std::cout << "Client" << std::endl;
+  static void OnEnd(RDMAConnection* conn) {
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
+    h->Emit("onend", 0, NULL);
+  }
 
-    // ("addr", port)
-    assert(args.Length() >= 2);
-    assert(args[0]->IsString());
-    assert(args[1]->IsInt32());
+  static void OnExpose(RDMAConnection* conn) {
+    HandleScope scope;
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
 
-    String::AsciiValue ip_address(args[0]->ToString());
-    int port = args[1]->Int32Value();
+    Local<Value> argv[1] = { Integer::NewFromUnsigned(conn->peer_expose_length) };
+    h->Emit("onexpose", 1, argv);
+  }
 
-    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
-    rdma->clientCtx = new RDMAClientContext(*ip_address, port);
-    
+  //
+  // Runs the callback of a one-sided operation; reads and atomics hand over
+  // a copy of the data they fetched, window binds the new rkey.
+  //
+  static void OnOpDone(RDMAConnection* conn, RDMAOp* op, int status) {
+    HandleScope scope;
+    Persistent<Function>* cb = (Persistent<Function>*)op->data;
+
+    if (cb) {
+      Local<Value> argv[2];
+      int argc = 1;
+
+      argv[0] = Integer::New(status);
+
+      if (op->opcode == IBV_WR_BIND_MW) {
+        argv[1] = Integer::NewFromUnsigned(op->rkey);
+        argc = 2;
+      } else if (op->opcode != IBV_WR_RDMA_WRITE && op->opcode != IBV_WR_LOCAL_INV) {
+        argv[1] = Local<Value>::New(Null());
+        if (status == IBV_WC_SUCCESS) {
+          node::Buffer* buffer = node::Buffer::New(op->length);
+          memcpy(node::Buffer::Data(buffer), op->buf->addr, op->length);
+          argv[1] = Local<Object>::New(buffer->handle_);
+        }
+        argc = 2;
+      }
+
+      TryCatch try_catch;
+      (*cb)->Call(Context::GetCurrent()->Global(), argc, argv);
+      cb->Dispose();
+      delete cb;
+
+      if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+      }
+    }
+
+    if (op->buf) {
+      RDMAPoolPut(op->buf);
+    }
+    delete op;
   }
 
-  static Handle<Value> Bind(const Arguments& args) {
-    // ("addr", port)
-    assert(args.Length() >= 2);
-    assert(args[0]->IsString());
-    assert(args[1]->IsInt32());
+  static void OnClose(RDMAConnection* conn) {
+    RDMAConnectionHandle* h = (RDMAConnectionHandle*)conn->data;
 
-    RDMA *rdma = ObjectWrap::Unwrap<RDMA>(args.This());
+    // Leases whose read finished are owned by their Buffers; the rest were
+    // still being read into and the QP is about to go.
+    std::map<const char*, RDMABuffer*>::iterator it;
+    for (it = h->leases_.begin(); it != h->leases_.end(); ++it) {
+      RDMAPoolPut(it->second);
+    }
+    h->leases_.clear();
 
-    String::AsciiValue ip_address(args[0]->ToString());
-    int port = args[1]->Int32Value();
+    // Payloads advertised with MSG_RNDV_RTS whose MSG_RNDV_FIN never came.
+    // The peer loses access along with the QP.
+    std::set<RDMABuffer*>::iterator st;
+    for (st = h->staged_.begin(); st != h->staged_.end(); ++st) {
+      RDMAPoolPut(*st);
+    }
+    h->staged_.clear();
+
+    h->conn_ = NULL;
+
+    // Window operations were failed by now; the QP goes right after.
+    while (!h->windows_.empty()) {
+      int ret = h->FreeMW(h->windows_.begin()->first);
+      assert(ret == 0);
+    }
 
-    std::cout << "Bind" << std::endl;
-    std::cout << "addr: " << *ip_address << std::endl;
-    std::cout << "port: " << port << std::endl;
+    // The peer cannot reach the exposed memory any more; it goes back to
+    // the pool once JS lets go of the Buffer.
+    if (!h->exposed_.IsEmpty()) {
+      h->exposed_.Dispose();
+      h->exposed_.Clear();
+    }
 
+    h->Emit("onclose", 0, NULL);
+    h->Unref();
   }
 
-  static Handle<Value>  New(const Arguments& args) {
+  RDMAConnection*                     conn_;      ///< NULL once closed
+  std::map<const char*, RDMABuffer*>  leases_;    ///< Rendezvous reads in flight
+  std::set<RDMABuffer*>               staged_;    ///< Written, awaiting MSG_RNDV_FIN
+  Persistent<Object>                  exposed_;   ///< Buffer of expose(), if any
+  std::map<RDMAMW*, Persistent<Object> > windows_;  ///< Allocated memory windows
+};
 
+Persistent<Function> RDMAConnectionHandle::constructor;
+Persistent<ObjectTemplate> RDMAConnectionHandle::mw_template;
+
+//
+// this.onconnection(conn) with the JS handle of an established connection,
+// whose completions this object reports from now on.
+//
+void RDMA::EmitConnection(RDMAConnection* conn)
+{
     HandleScope scope;
-    if (!args.IsConstructCall()) {
-      return args.Callee()->NewInstance();
+
+    conn->owner = this;
+
+    Local<Value> argv[1] = { RDMAConnectionHandle::NewHandle(conn) };
+    if (handle_->Get(String::NewSymbol("onconnection"))->IsFunction()) {
+        node::MakeCallback(handle_, "onconnection", 1, argv);
     }
+}
 
-    try {
-      (new RDMA())->Wrap(args.This());
-    } catch (const char* msg) {
-      return ThrowException(Exception::Error(String::New(msg)));
+//
+// Completes a client() call, see RDMA::Client().
+//
+void RDMA::EmitClientConnection(Persistent<Function>* cb, RDMAConnection* conn, int status)
+{
+    HandleScope scope;
+
+    if (!cb) {
+        if (conn) {
+            EmitConnection(conn);
+        } else {
+            fprintf(stderr, "Failed to connect: %s\n", strerror(-status));
+        }
+        return;
     }
 
-    return args.This();
-  }
+    Local<Value> argv[2];
+    argv[0] = Integer::New(status);
+    argv[1] = Local<Value>::New(Null());
 
-  RDMA() {
-    val = 3;
-  }
+    if (conn) {
+        conn->owner = this;
+        argv[1] = RDMAConnectionHandle::NewHandle(conn);
+    }
 
-  ~RDMA() { }
+    TryCatch try_catch;
+    (*cb)->Call(Context::GetCurrent()->Global(), 2, argv);
+    cb->Dispose();
+    delete cb;
 
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+}
 
-};
+static void RDMAQueueCompletion(RDMA* owner, const struct ibv_wc* wc)
+{
+    RDMACompletion c;
+    c.status    = wc->status;
+    c.opcode    = wc->opcode;
+    c.byte_len  = wc->byte_len;
+    c.qp_num    = wc->qp_num;
+
+    owner->completions_.push_back(c);
+
+    if (!owner->completions_pending_) {
+        owner->completions_pending_ = true;
+        g_pending_owners.push_back(owner);
+    }
+}
+
+static void RDMAFlushCompletions()
+{
+    for (size_t i = 0; i < g_pending_owners.size(); i++) {
+        g_pending_owners[i]->EmitCompletions();
+    }
+
+    g_pending_owners.clear();
+}
+
+static void InitRDMA(Handle<Object> target)
+{
+    RDMA::Initialize(target);
+    RDMAConnectionHandle::Initialize(target);
+}
 
 extern "C" {
-NODE_MODULE(rdma, RDMA::Initialize);
+NODE_MODULE(rdma, InitRDMA);
 }
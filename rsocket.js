@@ -0,0 +1,224 @@
+var Duplex = require('stream').Duplex;
+var EventEmitter = require('events').EventEmitter;
+var util = require('util');
+var RSocket = require('./build/Release/rsocket').RSocket;
+
+// net.Socket/net.Server look-alikes over rsockets, so TCP-style code can
+// switch transports by swapping require('net') for require('./rsocket').
+
+function errnoError(syscall, errno) {
+  var e = new Error(syscall + ' failed, errno ' + errno);
+  e.errno = errno;
+  e.syscall = syscall;
+  return e;
+}
+
+function Socket(options) {
+  if (!(this instanceof Socket)) return new Socket(options);
+  Duplex.call(this, options);
+
+  this._handle = null;
+  this._connected = false;
+  this._writeCallback = null;
+  this._pendingWrites = [];   // Writes issued before the connection was up
+  this.destroyed = false;
+  this.remoteAddress = undefined;
+  this.remotePort = undefined;
+
+  if (options && options.handle) this._attach(options.handle);
+
+  this.once('finish', function() {
+    if (this._handle) this._handle.shutdown();
+  });
+}
+util.inherits(Socket, Duplex);
+
+Socket.prototype._attach = function(handle) {
+  var self = this;
+
+  this._handle = handle;
+  this._connected = true;
+
+  handle.ondata = function(slab, start, len) {
+    if (!self.push(slab.slice(start, start + len))) handle.read_stop();
+  };
+
+  handle.onend = function() {
+    self.push(null);
+  };
+
+  handle.ondrain = function() {
+    var cb = self._writeCallback;
+    self._writeCallback = null;
+    if (cb) cb();
+  };
+
+  handle.onerror = function(errno) {
+    self.destroy(errnoError('rsocket', errno));
+  };
+
+  try {
+    var peer = handle.peername();
+    this.remoteAddress = peer.address;
+    this.remotePort = peer.port;
+  } catch (e) {
+    // Not connected yet.
+  }
+};
+
+Socket.prototype.connect = function(port, host, cb) {
+  var self = this;
+
+  if (typeof host === 'function') {
+    cb = host;
+    host = '127.0.0.1';
+  }
+  if (cb) this.once('connect', cb);
+
+  var handle = new RSocket();
+  handle.onconnect = function(status) {
+    if (status !== 0) return self.destroy(errnoError('rconnect', status));
+    self._attach(handle);
+    self.emit('connect');
+
+    var writes = self._pendingWrites;
+    self._pendingWrites = [];
+    for (var i = 0; i < writes.length; i++) {
+      self._write(writes[i].chunk, writes[i].encoding, writes[i].cb);
+    }
+  };
+  this._handle = handle;
+
+  try {
+    handle.connect(host || '127.0.0.1', port);
+  } catch (e) {
+    process.nextTick(function() { self.destroy(e); });
+  }
+
+  return this;
+};
+
+Socket.prototype._write = function(chunk, encoding, cb) {
+  if (!this._handle) return cb(new Error('Socket is closed'));
+
+  // Writes before the connection is up wait for it.
+  if (!this._connected) {
+    return this._pendingWrites.push({ chunk: chunk, encoding: encoding, cb: cb });
+  }
+
+  if (this._handle.write(chunk)) {
+    cb();
+  } else {
+    this._writeCallback = cb;
+  }
+};
+
+Socket.prototype._read = function(size) {
+  var self = this;
+
+  if (!this._handle) return;
+
+  if (!this._connected) {
+    return this.once('connect', function() { self._read(size); });
+  }
+
+  this._handle.read_start();
+};
+
+Socket.prototype.destroy = function(err) {
+  if (this.destroyed) return;
+  this.destroyed = true;
+
+  if (this._handle) {
+    this._handle.close();
+    this._handle = null;
+  }
+  this._connected = false;
+
+  // Writes still in flight or waiting for the connection never complete.
+  var closed = new Error('Socket is closed');
+  var cb = this._writeCallback;
+  this._writeCallback = null;
+  if (cb) cb(closed);
+
+  var writes = this._pendingWrites;
+  this._pendingWrites = [];
+  for (var i = 0; i < writes.length; i++) {
+    writes[i].cb(closed);
+  }
+
+  if (err) this.emit('error', err);
+  this.emit('close', !!err);
+};
+
+// TCP knobs with no rsocket equivalent worth setting.
+Socket.prototype.setNoDelay = function() { return this; };
+Socket.prototype.setKeepAlive = function() { return this; };
+
+function Server(listener) {
+  if (!(this instanceof Server)) return new Server(listener);
+  EventEmitter.call(this);
+
+  if (listener) this.on('connection', listener);
+
+  this._handle = null;
+}
+util.inherits(Server, EventEmitter);
+
+Server.prototype.listen = function(port, host, backlog, cb) {
+  var self = this;
+
+  if (typeof host === 'function') {
+    cb = host;
+    host = undefined;
+  } else if (typeof backlog === 'function') {
+    cb = backlog;
+    backlog = undefined;
+  }
+  if (cb) this.once('listening', cb);
+
+  var handle = new RSocket();
+  handle.onconnection = function(client) {
+    self.emit('connection', new Socket({ handle: client }));
+  };
+  handle.onerror = function(errno) {
+    self.emit('error', errnoError('raccept', errno));
+  };
+
+  handle.bind(host || '0.0.0.0', port || 0);
+  handle.listen(backlog || 511);
+  this._handle = handle;
+
+  process.nextTick(function() { self.emit('listening'); });
+
+  return this;
+};
+
+Server.prototype.address = function() {
+  return this._handle ? this._handle.sockname() : null;
+};
+
+Server.prototype.close = function(cb) {
+  if (this._handle) {
+    this._handle.close();
+    this._handle = null;
+  }
+
+  if (cb) this.once('close', cb);
+
+  var self = this;
+  process.nextTick(function() { self.emit('close'); });
+
+  return this;
+};
+
+exports.Socket = Socket;
+exports.Server = Server;
+
+exports.createServer = function(listener) {
+  return new Server(listener);
+};
+
+exports.connect = exports.createConnection = function(port, host, cb) {
+  return new Socket().connect(port, host, cb);
+};
@@ -0,0 +1,781 @@
+//
+// Copyright 2011 Light Transport Entertainment, Inc.
+//
+// Licensed under BSD license
+//
+
+// node.js and v8
+#include <v8.h>
+#include <node.h>
+#include <node_buffer.h>
+#include <uv.h>
+
+// C/C++
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <deque>
+#include <map>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+// rsocket
+#include <rdma/rsocket.h>
+
+using namespace v8;
+using namespace node;
+
+
+Persistent<Function> rsocketConstructor;
+
+static Persistent<String> address_symbol;
+static Persistent<String> port_symbol;
+
+// Bytes read per rrecv().
+static const size_t RSOCKET_READ_SIZE = 64 * 1024;
+
+// rrecv() goes straight into a shared slab Buffer and JS gets
+// ondata(slab, offset, length) to slice, like stream_wrap does. A new slab
+// is started when less than RSOCKET_READ_SIZE is left; the old one lives on
+// as long as slices of it do.
+static const size_t RSOCKET_SLAB_SIZE = 1024 * 1024;
+static Persistent<Object> read_slab;
+static size_t read_slab_used;
+
+class RSocket;
+
+//
+// rsocket descriptors are not kernel fds, so the loop cannot watch them.
+// One poller thread rpoll()s every socket with pending interest (rpoll
+// busy-polls the CQ for a while before sleeping, which is where the
+// latency comes from) and hands the ready set to the loop through a
+// uv_async. It then waits until the loop has handled it, as the events are
+// level triggered.
+//
+// All poller state is guarded by `lock`. Interest changes wake the thread
+// through a pipe, which rpoll() watches like any other fd. Sockets are
+// rclose()d by the thread, so a descriptor is never closed under rpoll().
+//
+typedef struct
+{
+    pthread_mutex_t             lock;
+    pthread_cond_t              handled;        ///< Signaled when `ready` was consumed
+    pthread_t                   thread;
+    bool                        started;
+
+    int                         wake_pipe[2];
+    uv_async_t                  async;
+
+    std::map<int, RSocket*>*    sockets;        ///< fd -> socket with interest
+    std::vector<struct pollfd>* ready;          ///< Handed to the loop
+    bool                        ready_pending;
+    std::vector<int>*           closing;        ///< rclose() on the poller thread
+} RSocketPoller;
+
+static RSocketPoller g_poller;
+
+static void RSocketPollerWake()
+{
+    char c = 0;
+    ssize_t ret = write(g_poller.wake_pipe[1], &c, 1);
+    (void)ret;  // A full pipe already wakes the poller.
+}
+
+class RSocket : public node::ObjectWrap {
+public:
+
+  static void Initialize(Handle<Object> target) {
+
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    t->SetClassName(String::NewSymbol("RSocket"));
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+
+
+    // API
+    NODE_SET_PROTOTYPE_METHOD(t, "bind", Bind);
+    NODE_SET_PROTOTYPE_METHOD(t, "listen", Listen);
+    NODE_SET_PROTOTYPE_METHOD(t, "connect", Connect);
+    NODE_SET_PROTOTYPE_METHOD(t, "read_start", ReadStart);
+    NODE_SET_PROTOTYPE_METHOD(t, "read_stop", ReadStop);
+    NODE_SET_PROTOTYPE_METHOD(t, "write", Write);
+    NODE_SET_PROTOTYPE_METHOD(t, "shutdown", Shutdown);
+    NODE_SET_PROTOTYPE_METHOD(t, "close", Close);
+    NODE_SET_PROTOTYPE_METHOD(t, "sockname", SockName);
+    NODE_SET_PROTOTYPE_METHOD(t, "peername", PeerName);
+
+
+    rsocketConstructor = Persistent<Function>::New(t->GetFunction());
+
+    address_symbol = NODE_PSYMBOL("address");
+    port_symbol = NODE_PSYMBOL("port");
+
+    target->Set(String::NewSymbol("RSocket"), rsocketConstructor);
+
+  }
+
+  //
+  // Runs on the loop with the events rpoll() reported for this socket.
+  //
+  void OnEvents(short revents) {
+    HandleScope scope;
+
+    if (listening_) {
+      if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        Accept();
+      }
+      return;
+    }
+
+    if (connecting_) {
+      if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+        FinishConnect();
+      }
+      return;
+    }
+
+    if ((revents & (POLLOUT | POLLERR | POLLHUP)) && !write_queue_.empty()) {
+      Flush();
+    }
+
+    // Errors and hangups surface through rrecv().
+    if (reading_ && (revents & (POLLIN | POLLERR | POLLHUP))) {
+      Read();
+    }
+  }
+
+private:
+
+  struct PendingWrite {
+    Persistent<Object>  buffer;
+    size_t              offset;     // Bytes of buffer already sent
+  };
+
+  //
+  // ("host", port)
+  //
+  static Handle<Value> Bind(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+    assert(args[0]->IsString());
+    assert(args[1]->IsInt32());
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    String::AsciiValue host(args[0]->ToString());
+
+    struct sockaddr_in addr;
+    if (!ResolveAddr(*host, args[1]->Int32Value(), &addr)) {
+      return ThrowException(Exception::Error(String::New("Failed to resolve address")));
+    }
+
+    if (rbind(s->fd_, (struct sockaddr*)&addr, sizeof(addr))) {
+      return ThrowException(ErrnoException(errno, "rbind"));
+    }
+
+    return Undefined();
+  }
+
+  //
+  // (backlog) Accepted sockets are passed to this.onconnection(socket).
+  //
+  static Handle<Value> Listen(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(args[0]->IsInt32());
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    if (rlisten(s->fd_, args[0]->Int32Value())) {
+      return ThrowException(ErrnoException(errno, "rlisten"));
+    }
+
+    s->listening_ = true;
+    s->SetInterest(POLLIN);
+
+    return Undefined();
+  }
+
+  //
+  // ("host", port) Calls this.onconnect(status) once connected, status
+  // being 0 or an errno.
+  //
+  static Handle<Value> Connect(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 2);
+    assert(args[0]->IsString());
+    assert(args[1]->IsInt32());
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    String::AsciiValue host(args[0]->ToString());
+
+    struct sockaddr_in addr;
+    if (!ResolveAddr(*host, args[1]->Int32Value(), &addr)) {
+      return ThrowException(Exception::Error(String::New("Failed to resolve address")));
+    }
+
+    if (rconnect(s->fd_, (struct sockaddr*)&addr, sizeof(addr)) && errno != EINPROGRESS) {
+      return ThrowException(ErrnoException(errno, "rconnect"));
+    }
+
+    s->connecting_ = true;
+    s->SetInterest(POLLOUT);
+
+    return Undefined();
+  }
+
+  //
+  // Starts delivering this.ondata(slab, offset, length), and this.onend() at EOF.
+  //
+  static Handle<Value> ReadStart(const Arguments& args) {
+    HandleScope scope;
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    s->reading_ = true;
+    s->UpdateInterest();
+
+    return Undefined();
+  }
+
+  static Handle<Value> ReadStop(const Arguments& args) {
+    HandleScope scope;
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    s->reading_ = false;
+    s->UpdateInterest();
+
+    return Undefined();
+  }
+
+  //
+  // (buffer) -> true if the whole Buffer was sent. Otherwise the rest is
+  // held, without copying, until it can be sent and this.ondrain() runs
+  // once the queue is empty.
+  //
+  static Handle<Value> Write(const Arguments& args) {
+    HandleScope scope;
+
+    assert(args.Length() >= 1);
+    assert(Buffer::HasInstance(args[0]));
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    Local<Object> buffer = args[0]->ToObject();
+    size_t offset = 0;
+
+    if (s->write_queue_.empty()) {
+      ssize_t n = s->Send(Buffer::Data(buffer), Buffer::Length(buffer));
+      if (n < 0) {
+        return ThrowException(ErrnoException(errno, "rsend"));
+      }
+
+      offset = n;
+      if (offset == Buffer::Length(buffer)) {
+        return scope.Close(True());
+      }
+    }
+
+    PendingWrite w;
+    w.buffer = Persistent<Object>::New(buffer);
+    w.offset = offset;
+    s->write_queue_.push_back(w);
+
+    s->UpdateInterest();
+
+    return scope.Close(False());
+  }
+
+  //
+  // Shuts down the sending side once queued writes went out.
+  //
+  static Handle<Value> Shutdown(const Arguments& args) {
+    HandleScope scope;
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    s->shutdown_pending_ = true;
+    if (s->write_queue_.empty()) {
+      s->DoShutdown();
+    }
+
+    return Undefined();
+  }
+
+  static Handle<Value> Close(const Arguments& args) {
+    HandleScope scope;
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    s->DoClose();
+
+    return Undefined();
+  }
+
+  static Handle<Value> SockName(const Arguments& args) {
+    return GetName(args, rgetsockname, "rgetsockname");
+  }
+
+  static Handle<Value> PeerName(const Arguments& args) {
+    return GetName(args, rgetpeername, "rgetpeername");
+  }
+
+  // -> { address, port }
+  static Handle<Value> GetName(const Arguments& args,
+                               int (*fn)(int, struct sockaddr*, socklen_t*),
+                               const char* syscall) {
+    HandleScope scope;
+
+    RSocket *s = ObjectWrap::Unwrap<RSocket>(args.This());
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (fn(s->fd_, (struct sockaddr*)&addr, &len)) {
+      return ThrowException(ErrnoException(errno, syscall));
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+    Local<Object> name = Object::New();
+    name->Set(address_symbol, String::New(ip));
+    name->Set(port_symbol, Integer::New(ntohs(addr.sin_port)));
+
+    return scope.Close(name);
+  }
+
+  static bool ResolveAddr(const char* host, int port, struct sockaddr_in* addr) {
+    struct addrinfo hints;
+    struct addrinfo* res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char service[16];
+    sprintf(service, "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &res)) {
+      return false;
+    }
+
+    memcpy(addr, res->ai_addr, sizeof(*addr));
+    freeaddrinfo(res);
+
+    return true;
+  }
+
+  //
+  // ([fd]) Wraps an accepted descriptor or creates a new stream rsocket.
+  //
+  static Handle<Value> New(const Arguments& args) {
+
+    HandleScope scope;
+    if (!args.IsConstructCall()) {
+      return args.Callee()->NewInstance();
+    }
+
+    int fd;
+    if (args.Length() >= 1 && args[0]->IsInt32()) {
+      fd = args[0]->Int32Value();
+    } else {
+      fd = rsocket(AF_INET, SOCK_STREAM, 0);
+      if (fd < 0) {
+        return ThrowException(ErrnoException(errno, "rsocket"));
+      }
+    }
+
+    // Never block the loop; readiness comes from the poller.
+    rfcntl(fd, F_SETFL, O_NONBLOCK);
+
+    (new RSocket(fd))->Wrap(args.This());
+
+    return args.This();
+  }
+
+  RSocket(int fd) : fd_(fd), interest_(0), listening_(false), connecting_(false),
+                    reading_(false), shutdown_pending_(false) {
+  }
+
+  ~RSocket() {
+    DoClose();
+  }
+
+  void Emit(const char* name, int argc, Handle<Value> argv[]) {
+    HandleScope scope;
+
+    Local<Value> cb = handle_->Get(String::NewSymbol(name));
+    if (!cb->IsFunction()) {
+      return;
+    }
+
+    node::MakeCallback(handle_, name, argc, argv);
+  }
+
+  ssize_t Send(const char* data, size_t len) {
+    size_t sent = 0;
+
+    while (sent < len) {
+      ssize_t n = rsend(fd_, data + sent, len - sent, 0);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        return -1;
+      }
+      sent += n;
+    }
+
+    return sent;
+  }
+
+  void Flush() {
+    while (!write_queue_.empty()) {
+      PendingWrite& w = write_queue_.front();
+      Local<Object> buffer = Local<Object>::New(w.buffer);
+      size_t len = Buffer::Length(buffer);
+
+      ssize_t n = Send(Buffer::Data(buffer) + w.offset, len - w.offset);
+      if (n < 0) {
+        EmitError(errno);
+        return;
+      }
+
+      w.offset += n;
+      if (w.offset < len) {
+        break;
+      }
+
+      w.buffer.Dispose();
+      write_queue_.pop_front();
+    }
+
+    UpdateInterest();
+
+    if (write_queue_.empty()) {
+      if (shutdown_pending_) {
+        DoShutdown();
+      }
+      Emit("ondrain", 0, NULL);
+    }
+  }
+
+  void Read() {
+    while (reading_) {
+      if (read_slab.IsEmpty() || RSOCKET_SLAB_SIZE - read_slab_used < RSOCKET_READ_SIZE) {
+        if (!read_slab.IsEmpty()) {
+          read_slab.Dispose();
+        }
+        read_slab = Persistent<Object>::New(Buffer::New(RSOCKET_SLAB_SIZE)->handle_);
+        read_slab_used = 0;
+      }
+
+      ssize_t n = rrecv(fd_, Buffer::Data(read_slab) + read_slab_used, RSOCKET_READ_SIZE, 0);
+
+      if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          EmitError(errno);
+        }
+        return;
+      }
+
+      if (n == 0) {
+        reading_ = false;
+        UpdateInterest();
+        Emit("onend", 0, NULL);
+        return;
+      }
+
+      Local<Value> argv[3] = {
+        Local<Object>::New(read_slab),
+        Integer::New(read_slab_used),
+        Integer::New(n)
+      };
+      read_slab_used += n;
+      Emit("ondata", 3, argv);
+    }
+  }
+
+  void Accept() {
+    for (;;) {
+      int fd = raccept(fd_, NULL, NULL);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          EmitError(errno);
+        }
+        return;
+      }
+
+      Local<Value> cargv[1] = { Integer::New(fd) };
+      Local<Object> client = rsocketConstructor->NewInstance(1, cargv);
+
+      Local<Value> argv[1] = { client };
+      Emit("onconnection", 1, argv);
+    }
+  }
+
+  void FinishConnect() {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (rgetsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len)) {
+      err = errno;
+    }
+
+    connecting_ = false;
+    UpdateInterest();
+
+    Local<Value> argv[1] = { Integer::New(err) };
+    Emit("onconnect", 1, argv);
+  }
+
+  void EmitError(int err) {
+    Local<Value> argv[1] = { Integer::New(err) };
+    Emit("onerror", 1, argv);
+  }
+
+  void DoShutdown() {
+    shutdown_pending_ = false;
+    rshutdown(fd_, SHUT_WR);
+  }
+
+  void DoClose() {
+    if (fd_ < 0) {
+      return;
+    }
+
+    listening_ = connecting_ = reading_ = false;
+    SetInterest(0);
+
+    while (!write_queue_.empty()) {
+      write_queue_.front().buffer.Dispose();
+      write_queue_.pop_front();
+    }
+
+    // The poller may be inside rpoll() on the descriptor.
+    pthread_mutex_lock(&g_poller.lock);
+    g_poller.closing->push_back(fd_);
+    pthread_mutex_unlock(&g_poller.lock);
+    RSocketPollerWake();
+
+    fd_ = -1;
+  }
+
+  void UpdateInterest() {
+    short events = 0;
+
+    if (listening_ || reading_) {
+      events |= POLLIN;
+    }
+    if (connecting_ || !write_queue_.empty()) {
+      events |= POLLOUT;
+    }
+
+    SetInterest(events);
+  }
+
+  //
+  // Registers the events the poller should watch for. A socket with
+  // interest keeps itself and the loop alive.
+  //
+  void SetInterest(short events);
+
+  int fd_;
+  short interest_;              // Guarded by g_poller.lock
+
+  bool listening_;
+  bool connecting_;
+  bool reading_;
+  bool shutdown_pending_;
+
+  std::deque<PendingWrite> write_queue_;
+
+  friend void* RSocketPollerMain(void* arg);
+};
+
+void* RSocketPollerMain(void* arg)
+{
+    std::vector<struct pollfd> fds;
+    std::vector<int> closing;
+
+    for (;;) {
+        pthread_mutex_lock(&g_poller.lock);
+
+        while (g_poller.ready_pending) {
+            pthread_cond_wait(&g_poller.handled, &g_poller.lock);
+        }
+
+        // rclose() may block on the CM; it runs once the lock is dropped.
+        closing.swap(*g_poller.closing);
+
+        fds.resize(1);
+        fds[0].fd = g_poller.wake_pipe[0];
+        fds[0].events = POLLIN;
+
+        std::map<int, RSocket*>::iterator it;
+        for (it = g_poller.sockets->begin(); it != g_poller.sockets->end(); ++it) {
+            struct pollfd p;
+            p.fd = it->first;
+            p.events = it->second->interest_;
+            p.revents = 0;
+            fds.push_back(p);
+        }
+
+        pthread_mutex_unlock(&g_poller.lock);
+
+        for (size_t i = 0; i < closing.size(); i++) {
+            rclose(closing[i]);
+        }
+        closing.clear();
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            fds[i].revents = 0;
+        }
+
+        int n = rpoll(&fds[0], fds.size(), -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "rpoll failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(g_poller.wake_pipe[0], drain, sizeof(drain)) > 0);
+        }
+
+        pthread_mutex_lock(&g_poller.lock);
+
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (fds[i].revents) {
+                g_poller.ready->push_back(fds[i]);
+            }
+        }
+
+        if (!g_poller.ready->empty()) {
+            g_poller.ready_pending = true;
+            uv_async_send(&g_poller.async);
+        }
+
+        pthread_mutex_unlock(&g_poller.lock);
+    }
+
+    return NULL;
+}
+
+//
+// Dispatches the ready set on the loop, then lets the poller go on.
+//
+static void OnPollerReady(uv_async_t* handle, int status)
+{
+    std::vector<struct pollfd> ready;
+
+    pthread_mutex_lock(&g_poller.lock);
+    ready.swap(*g_poller.ready);
+    pthread_mutex_unlock(&g_poller.lock);
+
+    for (size_t i = 0; i < ready.size(); i++) {
+        // The socket may have been closed by an earlier callback.
+        pthread_mutex_lock(&g_poller.lock);
+        std::map<int, RSocket*>::iterator it = g_poller.sockets->find(ready[i].fd);
+        RSocket* s = (it != g_poller.sockets->end()) ? it->second : NULL;
+        pthread_mutex_unlock(&g_poller.lock);
+
+        if (s) {
+            s->OnEvents(ready[i].revents);
+        }
+    }
+
+    pthread_mutex_lock(&g_poller.lock);
+    g_poller.ready_pending = false;
+    pthread_cond_signal(&g_poller.handled);
+    pthread_mutex_unlock(&g_poller.lock);
+}
+
+static void RSocketPollerStart()
+{
+    if (g_poller.started) {
+        return;
+    }
+
+    pthread_mutex_init(&g_poller.lock, NULL);
+    pthread_cond_init(&g_poller.handled, NULL);
+
+    int ret = pipe(g_poller.wake_pipe);
+    assert(ret == 0);
+    fcntl(g_poller.wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(g_poller.wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    g_poller.sockets        = new std::map<int, RSocket*>();
+    g_poller.ready          = new std::vector<struct pollfd>();
+    g_poller.ready_pending  = false;
+    g_poller.closing        = new std::vector<int>();
+
+    uv_async_init(uv_default_loop(), &g_poller.async, OnPollerReady);
+    // Only sockets with interest keep the loop alive, see SetInterest().
+    uv_unref((uv_handle_t*)&g_poller.async);
+
+    ret = pthread_create(&g_poller.thread, NULL, RSocketPollerMain, NULL);
+    assert(ret == 0);
+
+    g_poller.started = true;
+}
+
+void RSocket::SetInterest(short events)
+{
+    if (fd_ < 0 || events == interest_) {
+        return;
+    }
+
+    if (events && !interest_) {
+        Ref();
+    } else if (!events && interest_) {
+        Unref();
+    }
+
+    pthread_mutex_lock(&g_poller.lock);
+    size_t watched = g_poller.sockets->size();
+    interest_ = events;
+    if (events) {
+        (*g_poller.sockets)[fd_] = this;
+    } else {
+        g_poller.sockets->erase(fd_);
+    }
+    size_t now_watched = g_poller.sockets->size();
+    pthread_mutex_unlock(&g_poller.lock);
+
+    // The async handle keeps the loop alive while any socket is watched.
+    if (!watched && now_watched) {
+        uv_ref((uv_handle_t*)&g_poller.async);
+    } else if (watched && !now_watched) {
+        uv_unref((uv_handle_t*)&g_poller.async);
+    }
+
+    RSocketPollerWake();
+}
+
+static void InitRSocket(Handle<Object> target)
+{
+    RSocketPollerStart();
+    RSocket::Initialize(target);
+}
+
+extern "C" {
+NODE_MODULE(rsocket, InitRSocket);
+}
@@ -0,0 +1,29 @@
+var assert = require('assert')
+var IBV = require('./build/Release/rdma_cm').IBV
+
+var IBV_ACCESS_LOCAL_WRITE = 1
+
+var ibv = new IBV()
+ibv.pd()
+
+// Unlimited (the default): an MR is deregistered with its last reference.
+var buf = new Buffer(1 << 20)
+var mr = ibv.mr(buf, IBV_ACCESS_LOCAL_WRITE)
+assert.equal(ibv.mr_cache_stats().pinned_bytes, buf.length)
+
+ibv.dereg_mr(mr)
+assert.equal(ibv.mr_cache_stats().pinned_bytes, 0)
+
+// With a ceiling idle MRs are kept for reuse...
+ibv.set_mr_cache_limit(4 << 20)
+ibv.dereg_mr(ibv.mr(buf, IBV_ACCESS_LOCAL_WRITE))
+assert.equal(ibv.mr_cache_stats().pinned_bytes, buf.length)
+
+ibv.dereg_mr(ibv.mr(buf, IBV_ACCESS_LOCAL_WRITE))
+assert.equal(ibv.mr_cache_stats().hits, 1)
+
+// ...and released when caching is turned off again.
+ibv.set_mr_cache_limit(0)
+assert.equal(ibv.mr_cache_stats().pinned_bytes, 0)
+
+console.log('ok')
@@ -0,0 +1,92 @@
+var assert = require('assert')
+var RDMA = require('./build/Release/rdma').RDMA
+
+// An address of an RDMA device, e.g. of an rxe link on the loopback host.
+var addr = process.env.RDMA_ADDR || '127.0.0.1'
+
+var IBV_ACCESS_REMOTE_WRITE = 2
+var IBV_ACCESS_REMOTE_READ = 4
+
+var server = new RDMA()
+server.server()
+
+var exposed
+var server_conn
+var mw
+
+server.onconnection = function(conn) {
+  server_conn = conn
+
+  // Nothing is granted until the window is bound.
+  exposed = conn.expose(4096, false)
+  exposed.write('behind a window', 1024)
+
+  try {
+    mw = conn.alloc_mw(1)
+  } catch (e) {
+    console.log('skipped: ' + e.message)
+    process.exit(0)
+  }
+
+  assert.throws(function() { conn.bind_mw(mw, 4000, 200, IBV_ACCESS_REMOTE_READ) }, RangeError)
+  assert.throws(function() { conn.dealloc_mw({}) }, TypeError)
+  assert.throws(function() { conn.invalidate_mw(conn) }, TypeError)
+
+  conn.bind_mw(mw, 1024, 64, IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE, function(status, rkey) {
+    assert.equal(status, 0)
+  })
+}
+
+var client = new RDMA()
+
+var exposures = 0
+
+client.client(addr, server.server_stats().port, function(status, conn) {
+  assert.equal(status, 0)
+
+  conn.onexpose = function(length) {
+    exposures++
+
+    if (exposures == 2) {
+      // Revoked.
+      assert.equal(length, 0)
+      assert.throws(function() { conn.read_remote(0, 15) })
+      return done()
+    }
+
+    // Offsets are relative to the window.
+    assert.equal(length, 64)
+    assert.throws(function() { conn.read_remote(60, 8) }, RangeError)
+
+    conn.read_remote(0, 15, function(status, buf) {
+      assert.equal(status, 0)
+      assert.equal(buf.toString(), 'behind a window')
+
+      conn.write_remote(new Buffer('through'), 32, function(status) {
+        assert.equal(status, 0)
+        assert.equal(exposed.toString('utf8', 1056, 1063), 'through')
+
+        server_conn.invalidate_mw(mw, function(status) {
+          assert.equal(status, 0)
+          server_conn.dealloc_mw(mw)
+          done()
+        })
+      })
+    })
+  }
+})
+
+// The revocation reaches the client and completes on the server in
+// either order.
+var pending = 2
+
+function done() {
+  if (--pending == 0) {
+    console.log('ok')
+    process.exit(0)
+  }
+}
+
+setTimeout(function() {
+  assert.fail(null, null, 'timed out')
+}, 5000)
@@ -0,0 +1,66 @@
+var assert = require('assert')
+var RDMA = require('./build/Release/rdma').RDMA
+
+// An address of an RDMA device, e.g. of an rxe link on the loopback host.
+var addr = process.env.RDMA_ADDR || '127.0.0.1'
+
+var server = new RDMA()
+server.server()
+
+var exposed
+
+server.onconnection = function(conn) {
+  exposed = conn.expose(4096)
+  exposed.write('served by the HCA', 0)
+}
+
+var client = new RDMA()
+
+var client_conn
+
+client.client(addr, server.server_stats().port, function(status, conn) {
+  assert.equal(status, 0)
+  client_conn = conn
+
+  conn.onexpose = function(length) {
+    assert.equal(length, 4096)
+
+    assert.throws(function() { conn.read_remote(4000, 100) }, RangeError)
+
+    conn.read_remote(0, 17, function(status, buf) {
+      assert.equal(status, 0)
+      assert.equal(buf.toString(), 'served by the HCA')
+
+      conn.write_remote(new Buffer('written'), 100, function(status) {
+        assert.equal(status, 0)
+        assert.equal(exposed.toString('utf8', 100, 107), 'written')
+        atomics()
+      })
+    })
+  }
+})
+
+// 64-bit operands above 2^53 go as [hi, lo] and must arrive intact.
+function atomics() {
+  var conn = client_conn
+
+  conn.fetch_add(200, [0xffffffff, 0xfffffffe], function(status, prev) {
+    assert.equal(status, 0)
+    assert.equal(prev.toString('hex'), '0000000000000000')
+    assert.equal(exposed.readUInt32LE(200), 0xfffffffe)
+    assert.equal(exposed.readUInt32LE(204), 0xffffffff)
+
+    conn.cmp_swap(200, [0xffffffff, 0xfffffffe], 7, function(status, prev) {
+      assert.equal(status, 0)
+      assert.equal(prev.readUInt32LE(4), 0xffffffff)
+      assert.equal(exposed.readUInt32LE(200), 7)
+      assert.equal(exposed.readUInt32LE(204), 0)
+      console.log('ok')
+      process.exit(0)
+    })
+  })
+}
+
+setTimeout(function() {
+  assert.fail(null, null, 'timed out')
+}, 5000)
@@ -0,0 +1,43 @@
+var assert = require('assert')
+var RDMA = require('./build/Release/rdma').RDMA
+
+// An address of an RDMA device, e.g. of an rxe link on the loopback host.
+var addr = process.env.RDMA_ADDR || '127.0.0.1'
+
+var small = new Buffer('ring write')            // Through the write ring
+var large = new Buffer(64 * 1024)               // Rendezvous read
+for (var i = 0; i < large.length; i++) large[i] = i & 0xff
+
+var expected = Buffer.concat([small, large])
+var received = []
+var nreceived = 0
+
+var server = new RDMA()
+server.server()
+
+server.onconnection = function(conn) {
+  conn.ondata = function(buf) {
+    received.push(new Buffer(buf))
+    nreceived += buf.length
+
+    if (nreceived === expected.length) {
+      assert.equal(Buffer.concat(received).toString('hex'), expected.toString('hex'))
+      console.log('ok')
+      process.exit(0)
+    }
+  }
+}
+
+var client = new RDMA()
+
+// The writes are issued before the peer's ring is known and must go out
+// once it arrives.
+client.client(addr, server.server_stats().port, function(status, conn) {
+  assert.equal(status, 0)
+  conn.write(small)
+  conn.write(large)
+})
+
+setTimeout(function() {
+  assert.fail(nreceived, expected.length, 'timed out waiting for data')
+}, 5000)